@@ -0,0 +1,112 @@
+#pragma once
+
+#include "tracing.h"
+
+#include <cstddef>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+// Where the memory comes from. Control blocks for `T` objects are allocated and freed through
+// `AllocationBackend<T>`, and so are the objects which live inside them (`MakeShared`) and the
+// arrays of containers like `PolyVector`. Frees always get the size and the alignment, which
+// jemalloc/tcmalloc-style allocators (or a local slab allocator) use to skip the lookup.
+//
+// A backend is a type with static `Allocate(size, align)` and `Deallocate(ptr, size, align)`.
+// Define `SMART_POINTERS_ALLOCATION_BACKEND` to replace the default one everywhere, or specialize
+// `AllocationBackendFor<T>` for particular types.
+//
+// Objects adopted by pointer (`SharedPtr(T*)`, `UniquePtr` with `DefaultDeleter`) are not ours:
+// they come from plain `new` and go back with plain `delete`, whatever the backend is.
+// `New<T>` and `Delete` are a pair for the objects we allocate and free ourselves. Objects with
+// virtual destructors and classes with their own `operator delete` go through `new` and `delete`
+// there too: only the compiler knows the size of what is actually there.
+
+struct DefaultAllocationBackend {
+    static void* Allocate(size_t size, size_t align) {
+        if (align > __STDCPP_DEFAULT_NEW_ALIGNMENT__) {
+            return ::operator new(size, std::align_val_t(align));
+        }
+        return ::operator new(size);
+    }
+
+    static void Deallocate(void* ptr, size_t size, size_t align) noexcept {
+        if (align > __STDCPP_DEFAULT_NEW_ALIGNMENT__) {
+            ::operator delete(ptr, size, std::align_val_t(align));
+        } else {
+            ::operator delete(ptr, size);
+        }
+    }
+};
+
+#ifndef SMART_POINTERS_ALLOCATION_BACKEND
+#define SMART_POINTERS_ALLOCATION_BACKEND DefaultAllocationBackend
+#endif
+
+template <typename T>
+struct AllocationBackendFor {
+    using Type = SMART_POINTERS_ALLOCATION_BACKEND;
+};
+
+template <typename T>
+using AllocationBackend = typename AllocationBackendFor<std::remove_cv_t<T>>::Type;
+
+template <typename T>
+inline constexpr bool kDeletedByCompiler =
+    std::has_virtual_destructor_v<T> ||
+    requires(void* ptr) { T::operator delete(ptr); } ||
+    requires(void* ptr) { T::operator delete(ptr, size_t()); } ||
+    requires(void* ptr) { T::operator delete(ptr, std::align_val_t()); } ||
+    requires(void* ptr) { T::operator delete(ptr, size_t(), std::align_val_t()); };
+
+// `new T(args...)` from the backend of `T`
+template <typename T, typename... Args>
+T* New(Args&&... args) {
+    if constexpr (kDeletedByCompiler<T>) {
+        return new T(std::forward<Args>(args)...);
+    } else {
+        void* memory = AllocationBackend<T>::Allocate(sizeof(T), alignof(T));
+        try {
+            return new (memory) T(std::forward<Args>(args)...);
+        } catch (...) {
+            AllocationBackend<T>::Deallocate(memory, sizeof(T), alignof(T));
+            throw;
+        }
+    }
+}
+
+// `delete ptr` for what `New<T>` has created
+template <typename T>
+constexpr void Delete(T* ptr) {
+    if constexpr (kDeletedByCompiler<T>) {
+        delete ptr;
+    } else {
+        // Polymorphic types get here only without a virtual destructor, when `ptr` is known to be
+        // of exactly type `T`: `delete` would warn about it in vain
+        if constexpr (!std::is_polymorphic_v<T>) {
+            if (std::is_constant_evaluated()) {
+                delete ptr;
+                return;
+            }
+        }
+        ptr->~T();
+        AllocationBackend<T>::Deallocate(const_cast<std::remove_cv_t<T>*>(ptr), sizeof(T),
+                                         alignof(T));
+    }
+}
+
+// Class-specific `new` and `delete` for `Self`, a control block for `T`s. The blocks have virtual
+// destructors, so `delete` gets the size of the actual block.
+template <typename Self, typename T>
+struct BackendAllocated {
+    static void* operator new(size_t size) {
+        void* ptr = AllocationBackend<T>::Allocate(size, alignof(Self));
+        SMART_POINTERS_PROBE(block_new, T, ptr);
+        return ptr;
+    }
+
+    static void operator delete(void* ptr, size_t size) {
+        SMART_POINTERS_PROBE(block_free, T, ptr);
+        AllocationBackend<T>::Deallocate(ptr, size, alignof(Self));
+    }
+};
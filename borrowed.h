@@ -0,0 +1,178 @@
+#pragma once
+
+#include "shared.h"
+#include "unique.h"
+
+#include <cassert>
+#include <cstdint>
+#include <type_traits>
+
+// Non-owning handle to an object owned by a `SharedPtr` (e.g. a `WeakPtr::Lock` result) or a
+// `UniquePtr`, for passing it down the call stack without touching the reference count.
+//
+// It refers to the owner itself, same as `const SharedPtr<T>&` would, so in release builds it is
+// one pointer wide and trivially copyable. Like any reference it must not outlive the owner;
+// borrowing from a temporary does not compile.
+//
+// `SharedBorrowed` can only be taken from a `SharedPtr`, and `ToShared` can join the owners when
+// a callee really needs to keep the object. It converts to a plain `Borrowed`.
+//
+// In debug builds a borrow pins the control block of the object it was taken for with a weak
+// reference, and every access checks that this object is still alive, so moving the owner on to
+// another object under a live borrow counts as dangling too. Borrows of a `UniquePtr` and of a
+// `SharedPtr` without a block (empty, or lazy with no copies yet) are not checked.
+template <typename T, bool Shared>
+class Borrowed {
+    using U = std::remove_const_t<T>;
+
+public:
+    ////////////////////////////////////////////////////////////////////////////////////////////////
+    // Constructors
+
+    Borrowed(const SharedPtr<U>& owner) : bits_(Pack(&owner, kShared)) {
+        Pin(owner.LoadBlock());
+    }
+
+    template <typename Y, std::enable_if_t<std::is_const_v<T> && std::is_same_v<Y, T>, int> = 0>
+    Borrowed(const SharedPtr<Y>& owner) : bits_(Pack(&owner, kSharedConst)) {
+        Pin(owner.LoadBlock());
+    }
+
+    template <typename Y, typename D,
+              std::enable_if_t<!Shared && std::is_same_v<std::remove_const_t<Y>, U> &&
+                                   (std::is_const_v<T> || !std::is_const_v<Y>),
+                               int> = 0>
+    Borrowed(const UniquePtr<Y, D>& owner) : bits_(Pack(&owner.data_.GetFirst(), kUnique)){};
+
+    template <bool S = Shared, std::enable_if_t<!S, int> = 0>
+    Borrowed(const Borrowed<T, true>& other) : bits_(other.bits_) {
+        Pin(other.Pinned());
+    }
+
+    Borrowed(SharedPtr<U>&&) = delete;
+    template <typename Y, std::enable_if_t<std::is_const_v<T> && std::is_same_v<Y, T>, int> = 0>
+    Borrowed(SharedPtr<Y>&&) = delete;
+    template <typename Y, typename D>
+    Borrowed(UniquePtr<Y, D>&&) = delete;
+
+#ifndef NDEBUG
+    Borrowed(const Borrowed& other) : bits_(other.bits_) {
+        Pin(other.pin_);
+    }
+
+    Borrowed& operator=(const Borrowed& other) {
+        if (this != &other) {
+            Unpin();
+            bits_ = other.bits_;
+            Pin(other.pin_);
+        }
+        return *this;
+    }
+
+    ~Borrowed() {
+        Unpin();
+    }
+
+    // Whether the object this was borrowed for is gone, which `Get` asserts against
+    bool Dangling() const {
+        return pin_ && pin_->GetCount() == 0;
+    }
+#endif
+
+    ////////////////////////////////////////////////////////////////////////////////////////////////
+    // Observers
+
+    T* Get() const {
+        CheckAlive();
+        // Both owners keep the raw pointer at the address we point to, see `Pack`
+        return *reinterpret_cast<T* const*>(bits_ & ~kTagMask);
+    }
+
+    T& operator*() const {
+        return *Get();
+    }
+
+    T* operator->() const {
+        return Get();
+    }
+
+    explicit operator bool() const {
+        return (Get() != nullptr);
+    }
+
+    ////////////////////////////////////////////////////////////////////////////////////////////////
+    // Ownership
+
+    // One more owner, one increment
+    SharedPtr<T> ToShared() const {
+        static_assert(Shared, "only a SharedBorrowed knows a SharedPtr to share");
+        CheckAlive();
+        if ((bits_ & kTagMask) == kShared) {
+            return SharedPtr<T>(*reinterpret_cast<const SharedPtr<U>*>(bits_ & ~kTagMask));
+        }
+        if constexpr (std::is_const_v<T>) {
+            return *reinterpret_cast<const SharedPtr<T>*>(bits_ & ~kTagMask);
+        }
+        return SharedPtr<T>();
+    }
+
+private:
+    // `SharedPtr` keeps the raw pointer as its first member, and standard layout makes the owner
+    // and that member pointer-interconvertible, so `Get` does not have to know who the owner is.
+    static_assert(std::is_standard_layout_v<SharedPtr<U>>);
+    static_assert(alignof(void*) > 2, "no spare bits for the tag");
+
+    static constexpr std::uintptr_t kUnique = 0;
+    static constexpr std::uintptr_t kShared = 1;
+    static constexpr std::uintptr_t kSharedConst = 2;
+    static constexpr std::uintptr_t kTagMask = 3;
+
+    static std::uintptr_t Pack(const void* address, std::uintptr_t tag) {
+        return reinterpret_cast<std::uintptr_t>(address) | tag;
+    }
+
+#ifndef NDEBUG
+    void Pin(ControlBlock* block) {
+        pin_ = block;
+        if (pin_) {
+            pin_->WeakIncrement();
+        }
+    }
+
+    void Unpin() {
+        if (pin_ && pin_->WeakDecrement() == 0) {
+            pin_->BlockDelete();
+        }
+        pin_ = nullptr;
+    }
+
+    ControlBlock* Pinned() const {
+        return pin_;
+    }
+
+    void CheckAlive() const {
+        assert(!Dangling() && "borrowed object is dead");
+    }
+#else
+    void Pin(ControlBlock*) {
+    }
+
+    ControlBlock* Pinned() const {
+        return nullptr;
+    }
+
+    void CheckAlive() const {
+    }
+#endif
+
+    std::uintptr_t bits_;
+#ifndef NDEBUG
+    ControlBlock* pin_ = nullptr;
+#endif
+
+    template <typename Y, bool S>
+    friend class Borrowed;
+};
+
+template <typename T>
+using SharedBorrowed = Borrowed<T, true>;
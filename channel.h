@@ -0,0 +1,282 @@
+#pragma once
+
+#include "compressed_pair.h"
+#include "unique.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <span>
+#include <utility>
+
+// Channels which hand `UniquePtr<T, D>`s over between threads without locks.
+//
+// Inside they hold the raw pointer and the deleter (which takes no space when it is empty, as in
+// `UniquePtr` itself), and the `UniquePtr` is put back together on the other side. Whatever is
+// still in a channel when it is destroyed gets deleted with its own deleter. Pushed empty pointers
+// come out as empty pointers.
+//
+//  * `MpmcChannel`: bounded, any number of producers and consumers. A ring of cells with sequence
+//    numbers (Dmitry Vyukov's queue): a push or a pop is one CAS on the tail or the head, and the
+//    batch versions claim a whole run of cells with that one CAS.
+//  * `SpscChannel`: unbounded, one producer and one consumer. A list of fixed-size segments with no
+//    CAS at all. The consumer keeps one drained segment around for the producer to reuse, so a
+//    channel that does not grow does not allocate.
+
+template <typename T, typename D = DefaultDeleter<T>>
+class MpmcChannel {
+public:
+    using Pointer = UniquePtr<T, D>;
+
+    ////////////////////////////////////////////////////////////////////////////////////////////////
+    // Constructors
+
+    // Rounded up to a power of two
+    explicit MpmcChannel(size_t capacity) {
+        size_t size = 2;
+        while (size < capacity) {
+            size <<= 1;
+        }
+        cells_ = new Cell[size];
+        mask_ = size - 1;
+        for (size_t i = 0; i < size; ++i) {
+            cells_[i].sequence.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    MpmcChannel(const MpmcChannel&) = delete;
+    MpmcChannel& operator=(const MpmcChannel&) = delete;
+
+    ////////////////////////////////////////////////////////////////////////////////////////////////
+    // Destructor
+
+    ~MpmcChannel() {
+        Pointer ptr;
+        while (TryPop(ptr)) {
+            ptr.Reset();
+        }
+        delete[] cells_;
+    }
+
+    ////////////////////////////////////////////////////////////////////////////////////////////////
+    // Producers
+
+    // Takes `ptr` unless the channel is full
+    bool TryPush(Pointer& ptr) {
+        return TryPushBatch(std::span<Pointer>(&ptr, 1)) == 1;
+    }
+
+    // Takes as many of `ptrs` from the front as there is room for. Returns how many.
+    size_t TryPushBatch(std::span<Pointer> ptrs) {
+        size_t count = 0;
+        size_t pos = Claim(tail_, 0, ptrs.size(), count);
+        for (size_t i = 0; i < count; ++i) {
+            auto& cell = cells_[(pos + i) & mask_];
+            cell.value.GetSecond() = std::move(ptrs[i].GetDeleter());
+            cell.value.GetFirst() = ptrs[i].Release();
+            cell.sequence.store(pos + i + 1, std::memory_order_release);
+        }
+        return count;
+    }
+
+    ////////////////////////////////////////////////////////////////////////////////////////////////
+    // Consumers
+
+    // Replaces `out` unless the channel is empty
+    bool TryPop(Pointer& out) {
+        return TryPopBatch(std::span<Pointer>(&out, 1)) == 1;
+    }
+
+    // Fills the front of `out`. Returns how many.
+    size_t TryPopBatch(std::span<Pointer> out) {
+        size_t count = 0;
+        size_t pos = Claim(head_, 1, out.size(), count);
+        for (size_t i = 0; i < count; ++i) {
+            auto& cell = cells_[(pos + i) & mask_];
+            out[i] = Pointer(cell.value.GetFirst(), std::move(cell.value.GetSecond()));
+            cell.value.GetFirst() = nullptr;
+            cell.sequence.store(pos + i + mask_ + 1, std::memory_order_release);
+        }
+        return count;
+    }
+
+    ////////////////////////////////////////////////////////////////////////////////////////////////
+    // Observers
+
+    size_t Capacity() const {
+        return mask_ + 1;
+    }
+
+    // A snapshot, might be stale by the time it returns
+    size_t Size() const {
+        size_t head = head_.load(std::memory_order_relaxed);
+        size_t tail = tail_.load(std::memory_order_relaxed);
+        return tail > head ? tail - head : 0;
+    }
+
+private:
+    static constexpr size_t kCacheLine = 64;
+
+    // `sequence` is the position the cell waits for: `pos` while free for a push at `pos`,
+    // `pos + 1` once it holds that push, `pos + capacity` after the pop frees it for the next lap
+    struct Cell {
+        std::atomic<size_t> sequence;
+        CompressedPair<T*, D> value;
+    };
+
+    // Claims up to `max` consecutive cells at `index` which are ready, i.e. whose sequence is
+    // their position plus `ready`. Returns the first position, `count` is how many.
+    size_t Claim(std::atomic<size_t>& index, size_t ready, size_t max, size_t& count) {
+        size_t pos = index.load(std::memory_order_relaxed);
+        while (max != 0) {
+            count = 0;
+            while (count < max && cells_[(pos + count) & mask_].sequence.load(
+                                      std::memory_order_acquire) == pos + count + ready) {
+                ++count;
+            }
+            if (count == 0) {
+                auto sequence = cells_[pos & mask_].sequence.load(std::memory_order_acquire);
+                if (static_cast<intptr_t>(sequence - (pos + ready)) < 0) {
+                    return pos;  // full or empty
+                }
+                // Someone else has taken it
+                pos = index.load(std::memory_order_relaxed);
+            } else if (index.compare_exchange_weak(pos, pos + count, std::memory_order_relaxed)) {
+                return pos;
+            }
+        }
+        count = 0;
+        return pos;
+    }
+
+    Cell* cells_;
+    size_t mask_;
+    alignas(kCacheLine) std::atomic<size_t> tail_ = 0;
+    alignas(kCacheLine) std::atomic<size_t> head_ = 0;
+};
+
+template <typename T, typename D = DefaultDeleter<T>>
+class SpscChannel {
+public:
+    using Pointer = UniquePtr<T, D>;
+
+    static constexpr size_t kSegmentSize = 128;
+
+    ////////////////////////////////////////////////////////////////////////////////////////////////
+    // Constructors
+
+    SpscChannel() : head_(new Segment), tail_(head_){};
+
+    SpscChannel(const SpscChannel&) = delete;
+    SpscChannel& operator=(const SpscChannel&) = delete;
+
+    ////////////////////////////////////////////////////////////////////////////////////////////////
+    // Destructor
+
+    ~SpscChannel() {
+        Pointer ptr;
+        while (TryPop(ptr)) {
+            ptr.Reset();
+        }
+        delete head_;
+        delete spare_.load(std::memory_order_relaxed);
+    }
+
+    ////////////////////////////////////////////////////////////////////////////////////////////////
+    // Producer
+
+    void Push(Pointer ptr) {
+        PushBatch(std::span<Pointer>(&ptr, 1));
+    }
+
+    // Takes all of `ptrs`, they become visible to the consumer once per segment
+    void PushBatch(std::span<Pointer> ptrs) {
+        size_t done = 0;
+        while (done < ptrs.size()) {
+            if (write_ == kSegmentSize) {
+                // Allocate first: if that throws, nothing has changed
+                Segment* next = spare_.exchange(nullptr, std::memory_order_acquire);
+                if (!next) {
+                    next = new Segment;
+                }
+                tail_->next.store(next, std::memory_order_release);
+                tail_ = next;
+                write_ = 0;
+            }
+            size_t count = std::min(ptrs.size() - done, kSegmentSize - write_);
+            for (size_t i = 0; i < count; ++i) {
+                auto& value = tail_->values[write_ + i];
+                auto& ptr = ptrs[done + i];
+                value.GetSecond() = std::move(ptr.GetDeleter());
+                value.GetFirst() = ptr.Release();
+            }
+            write_ += count;
+            done += count;
+            tail_->written.store(write_, std::memory_order_release);
+        }
+    }
+
+    ////////////////////////////////////////////////////////////////////////////////////////////////
+    // Consumer
+
+    bool TryPop(Pointer& out) {
+        return TryPopBatch(std::span<Pointer>(&out, 1)) == 1;
+    }
+
+    size_t TryPopBatch(std::span<Pointer> out) {
+        size_t done = 0;
+        while (done < out.size()) {
+            size_t written = head_->written.load(std::memory_order_acquire);
+            if (read_ == written) {
+                if (read_ < kSegmentSize) {
+                    break;
+                }
+                // `next` is set before anything is written to it
+                Segment* next = head_->next.load(std::memory_order_acquire);
+                if (!next) {
+                    break;
+                }
+                Recycle(head_);
+                head_ = next;
+                read_ = 0;
+                continue;
+            }
+            size_t count = std::min(out.size() - done, written - read_);
+            for (size_t i = 0; i < count; ++i) {
+                auto& value = head_->values[read_ + i];
+                out[done + i] = Pointer(value.GetFirst(), std::move(value.GetSecond()));
+                value.GetFirst() = nullptr;
+            }
+            read_ += count;
+            done += count;
+        }
+        return done;
+    }
+
+private:
+    static constexpr size_t kCacheLine = 64;
+
+    struct Segment {
+        std::atomic<size_t> written = 0;
+        std::atomic<Segment*> next = nullptr;
+        CompressedPair<T*, D> values[kSegmentSize];
+    };
+
+    // Only the consumer gets here, once it has read the whole segment
+    void Recycle(Segment* segment) {
+        segment->written.store(0, std::memory_order_relaxed);
+        segment->next.store(nullptr, std::memory_order_relaxed);
+        delete spare_.exchange(segment, std::memory_order_release);
+    }
+
+    // Consumer side
+    alignas(kCacheLine) Segment* head_;
+    size_t read_ = 0;
+
+    // Producer side
+    alignas(kCacheLine) Segment* tail_;
+    size_t write_ = 0;
+
+    alignas(kCacheLine) std::atomic<Segment*> spare_ = nullptr;
+};
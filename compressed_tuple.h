@@ -0,0 +1,100 @@
+#pragma once
+
+#include <cstddef>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+
+// `CompressedPair` for any number of members: pointer, deleter, allocator, size... Empty non-final
+// members take no space, each of them is a base of its own leaf.
+
+template <class V>
+inline constexpr bool kIsCompressed = std::is_empty_v<V> && !std::is_final_v<V>;
+
+namespace compressed_tuple_detail {
+
+// `I` makes leaves with the same type distinct
+template <size_t I, typename T, bool compressed = kIsCompressed<T>>
+class Leaf {
+public:
+    constexpr Leaf() : value_(){};
+
+    template <typename U>
+    constexpr explicit Leaf(U&& value) : value_(std::forward<U>(value)){};
+
+    constexpr T& Get() {
+        return value_;
+    }
+
+    constexpr const T& Get() const {
+        return value_;
+    }
+
+private:
+    T value_;
+};
+
+template <size_t I, typename T>
+class Leaf<I, T, true> : T {
+public:
+    constexpr Leaf() : T(){};
+
+    template <typename U>
+    constexpr explicit Leaf(U&& value) : T(std::forward<U>(value)){};
+
+    constexpr T& Get() {
+        return *static_cast<T* const>(this);
+    }
+
+    constexpr const T& Get() const {
+        return *static_cast<const T* const>(this);
+    }
+};
+
+template <typename Indices, typename... Ts>
+class Storage;
+
+template <size_t... Is, typename... Ts>
+class Storage<std::index_sequence<Is...>, Ts...> : public Leaf<Is, Ts>... {
+public:
+    constexpr Storage() = default;
+
+    template <typename... Us>
+    constexpr explicit Storage(std::in_place_t, Us&&... values)
+        : Leaf<Is, Ts>(std::forward<Us>(values))...{};
+};
+
+}  // namespace compressed_tuple_detail
+
+template <typename... Ts>
+class CompressedTuple
+    : compressed_tuple_detail::Storage<std::index_sequence_for<Ts...>, Ts...> {
+    using Base = compressed_tuple_detail::Storage<std::index_sequence_for<Ts...>, Ts...>;
+
+    template <size_t I>
+    using Type = std::tuple_element_t<I, std::tuple<Ts...>>;
+
+    template <size_t I>
+    using LeafAt = compressed_tuple_detail::Leaf<I, Type<I>>;
+
+public:
+    constexpr CompressedTuple() = default;
+
+    // One value per member
+    template <typename... Us,
+              std::enable_if_t<sizeof...(Us) == sizeof...(Ts) && sizeof...(Us) != 0 &&
+                                   !(sizeof...(Us) == 1 &&
+                                     (std::is_same_v<std::decay_t<Us>, CompressedTuple> || ...)),
+                               int> = 0>
+    constexpr CompressedTuple(Us&&... values) : Base(std::in_place, std::forward<Us>(values)...){};
+
+    template <size_t I>
+    constexpr Type<I>& Get() {
+        return static_cast<LeafAt<I>&>(*this).Get();
+    }
+
+    template <size_t I>
+    constexpr const Type<I>& Get() const {
+        return static_cast<const LeafAt<I>&>(*this).Get();
+    }
+};
@@ -0,0 +1,446 @@
+#pragma once
+
+#include "shared.h"
+
+#include <algorithm>
+#include <cstddef>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+// Opt-in collector for reference cycles of `SharedPtr`s, based on trial deletion from
+// "Concurrent Cycle Collection in Reference Counted Systems" (Bacon, Rajan), synchronous version.
+//
+// Objects take part only if they are created with `MakeCollectable` and their type specializes
+// `CycleTraits`, which tells the collector about the `SharedPtr`s an object owns:
+//
+//     template <>
+//     struct CycleTraits<Node> {
+//         static void Visit(Node& node, CycleVisitor& visit) {
+//             visit(node.next);
+//             for (auto& child : node.children) {
+//                 visit(child);
+//             }
+//         }
+//     };
+//
+// Whenever such an object loses an owner but stays alive it becomes a candidate root of a garbage
+// cycle, and it stops being one as soon as it gains an owner again. `Collect` walks the subgraphs
+// below the remaining candidates, subtracts the references coming from inside of them, and
+// whatever ends up with no references from the outside is garbage. Garbage is
+// destroyed through the usual `ObjectDelete`/`BlockDelete` path, so destructors run and `WeakPtr`s
+// to it expire as always.
+//
+// The collector is per thread: a graph it manages must be owned and released by a single thread.
+//
+// Collection is not incremental: every `Collect` call traces, scans and frees its batch in one go.
+// Keeping the trial counts across calls would be unsound, because moving a `SharedPtr` from one
+// object to another changes the graph without touching any count, and only a write barrier on
+// every `SharedPtr` move could catch that. The pause grows with the subgraphs below the batch.
+
+template <typename T>
+struct CycleTraits;
+
+class CollectableBlockBase;
+
+class CycleVisitor {
+public:
+    template <typename Y>
+    void operator()(const SharedPtr<Y>& child);
+
+    // Weak edges own nothing and cannot keep a cycle alive
+    template <typename Y>
+    void operator()(const WeakPtr<Y>&) {
+    }
+
+private:
+    using Callback = void (*)(void* context, CollectableBlockBase* child);
+
+    CycleVisitor(Callback callback, void* context) : callback_(callback), context_(context){};
+
+    Callback callback_;
+    void* context_;
+
+    friend class CycleCollector;
+};
+
+class CollectableBlockBase : public ControlBlock {
+public:
+    virtual void VisitChildren(CycleVisitor& visitor) = 0;
+
+    void BlockDelete() override {
+        // The collector still has us in its buffer, it will free us when it gets there
+        if (buffered_) {
+            deferred_ = true;
+        } else {
+            delete this;
+        }
+    }
+
+protected:
+    // Black: in use or free. Gray: possible member of a cycle. White: member of a garbage cycle.
+    // Purple: possible root of a cycle. Dying: garbage being destroyed by the collector.
+    enum class Color { kBlack, kGray, kWhite, kPurple, kDying };
+
+    void PossibleRoot();
+
+    // A new owner: not a candidate anymore, `Collect` only drops it from the buffer
+    void Owned() {
+        if (color_ == Color::kPurple) {
+            color_ = Color::kBlack;
+        }
+    }
+
+    Color color_ = Color::kBlack;
+    bool buffered_ = false;
+    bool deferred_ = false;
+    // Trial reference count, the real one stays intact
+    int gc_count_ = 0;
+
+    friend class CycleCollector;
+};
+
+class CycleCollector {
+public:
+    static constexpr size_t kDefaultThreshold = 10000;
+
+    // Collector of the current thread
+    static CycleCollector& Instance() {
+        static thread_local CycleCollector collector;
+        return collector;
+    }
+
+    CycleCollector(const CycleCollector&) = delete;
+    CycleCollector& operator=(const CycleCollector&) = delete;
+
+    ~CycleCollector() {
+        // Too late to run user destructors, just do not leak the blocks we were keeping
+        for (auto root : roots_) {
+            root->buffered_ = false;
+            if (root->deferred_) {
+                delete root;
+            }
+        }
+    }
+
+    ////////////////////////////////////////////////////////////////////////////////////////////////
+    // Collection
+
+    // Looks at every candidate. Returns the number of objects freed.
+    size_t Collect() {
+        return Collect(roots_.size());
+    }
+
+    // Looks at no more than `max_roots` of the oldest candidates. This splits the candidates over
+    // several calls, it does not bound the pause: the subgraphs below them are traced in full.
+    size_t Collect(size_t max_roots) {
+        if (collecting_ || roots_.empty()) {
+            return 0;
+        }
+        collecting_ = true;
+        max_roots = std::min(max_roots, roots_.size());
+        std::vector<CollectableBlockBase*> batch(roots_.begin(), roots_.begin() + max_roots);
+        roots_.erase(roots_.begin(), roots_.begin() + max_roots);
+
+        MarkRoots(batch);
+        for (auto root : batch) {
+            Scan(root);
+        }
+        std::vector<CollectableBlockBase*> garbage;
+        for (auto root : batch) {
+            root->buffered_ = false;
+        }
+        for (auto root : batch) {
+            CollectWhite(root, garbage);
+        }
+        Free(garbage);
+
+        collected_ += garbage.size();
+        collecting_ = false;
+        return garbage.size();
+    }
+
+    // Candidates are collected automatically on `MakeCollectable` once there are at least
+    // `threshold` of them. Zero turns that off.
+    void SetThreshold(size_t threshold) {
+        threshold_ = threshold;
+    }
+
+    ////////////////////////////////////////////////////////////////////////////////////////////////
+    // Observers
+
+    size_t Candidates() const {
+        return roots_.size();
+    }
+
+    // Objects freed by this collector so far
+    size_t Collected() const {
+        return collected_;
+    }
+
+private:
+    using Color = CollectableBlockBase::Color;
+
+    CycleCollector() = default;
+
+    void AddRoot(CollectableBlockBase* block) {
+        roots_.push_back(block);
+    }
+
+    void MaybeCollect() {
+        if (threshold_ != 0 && roots_.size() >= threshold_) {
+            Collect();
+        }
+    }
+
+    template <typename F>
+    static void ForEachChild(CollectableBlockBase* block, F&& f) {
+        CycleVisitor visitor(
+            [](void* context, CollectableBlockBase* child) {
+                (*static_cast<std::remove_reference_t<F>*>(context))(child);
+            },
+            &f);
+        block->VisitChildren(visitor);
+    }
+
+    void MarkRoots(std::vector<CollectableBlockBase*>& batch) {
+        size_t live = 0;
+        for (auto root : batch) {
+            // Died on its own after being buffered. Mind that the sole owner skips the decrement,
+            // so only `deferred_` is reliable for blocks which are already freed.
+            if (root->deferred_) {
+                delete root;
+            } else if (root->color_ == Color::kPurple && root->GetCount() > 0) {
+                batch[live++] = root;
+                MarkGray(root);
+            } else {
+                // Owned again since it was buffered, or already traced from another root
+                root->buffered_ = false;
+            }
+        }
+        batch.resize(live);
+    }
+
+    // Subtract the references coming from inside of the subgraph
+    void MarkGray(CollectableBlockBase* root) {
+        auto mark = [this](CollectableBlockBase* block) {
+            block->color_ = Color::kGray;
+            block->gc_count_ = block->GetCount();
+            stack_.push_back(block);
+        };
+        if (root->color_ != Color::kGray) {
+            mark(root);
+        }
+        while (!stack_.empty()) {
+            auto block = stack_.back();
+            stack_.pop_back();
+            ForEachChild(block, [&mark](CollectableBlockBase* child) {
+                if (child->color_ != Color::kGray) {
+                    mark(child);
+                }
+                --child->gc_count_;
+            });
+        }
+    }
+
+    // Whatever still has outside references is alive, and so is everything reachable from it
+    void Scan(CollectableBlockBase* root) {
+        stack_.push_back(root);
+        while (!stack_.empty()) {
+            auto block = stack_.back();
+            stack_.pop_back();
+            if (block->color_ != Color::kGray) {
+                continue;
+            }
+            if (block->gc_count_ > 0) {
+                ScanBlack(block);
+                continue;
+            }
+            block->color_ = Color::kWhite;
+            ForEachChild(block, [this](CollectableBlockBase* child) {
+                if (child->color_ == Color::kGray) {
+                    stack_.push_back(child);
+                }
+            });
+        }
+    }
+
+    void ScanBlack(CollectableBlockBase* root) {
+        std::vector<CollectableBlockBase*> stack{root};
+        root->color_ = Color::kBlack;
+        while (!stack.empty()) {
+            auto block = stack.back();
+            stack.pop_back();
+            ForEachChild(block, [&stack](CollectableBlockBase* child) {
+                if (child->color_ != Color::kBlack) {
+                    child->color_ = Color::kBlack;
+                    stack.push_back(child);
+                }
+            });
+        }
+    }
+
+    void CollectWhite(CollectableBlockBase* root, std::vector<CollectableBlockBase*>& garbage) {
+        auto take = [this, &garbage](CollectableBlockBase* block) {
+            if (block->color_ == Color::kWhite && !block->buffered_) {
+                block->color_ = Color::kDying;
+                garbage.push_back(block);
+                stack_.push_back(block);
+            }
+        };
+        take(root);
+        while (!stack_.empty()) {
+            auto block = stack_.back();
+            stack_.pop_back();
+            ForEachChild(block, take);
+        }
+    }
+
+    void Free(const std::vector<CollectableBlockBase*>& garbage) {
+        // An extra reference each, so that garbage destroying garbage does not free it again
+        for (auto block : garbage) {
+            block->operator++();
+        }
+        for (auto block : garbage) {
+            block->Expire();
+        }
+        for (auto block : garbage) {
+            block->ObjectDelete();
+        }
+        for (auto block : garbage) {
+            if (block->operator--() == 0 && block->WeakDecrement() == 0) {
+                block->BlockDelete();
+            }
+        }
+    }
+
+    std::vector<CollectableBlockBase*> roots_;
+    std::vector<CollectableBlockBase*> stack_;
+    size_t threshold_ = kDefaultThreshold;
+    size_t collected_ = 0;
+    bool collecting_ = false;
+
+    friend class CollectableBlockBase;
+
+    template <typename TT, typename... Args>
+    friend SharedPtr<TT> MakeCollectable(Args&&... args);
+};
+
+inline void CollectableBlockBase::PossibleRoot() {
+    if (color_ == Color::kDying) {
+        return;
+    }
+    color_ = Color::kPurple;
+    if (!buffered_) {
+        buffered_ = true;
+        CycleCollector::Instance().AddRoot(this);
+    }
+}
+
+template <typename Y>
+void CycleVisitor::operator()(const SharedPtr<Y>& child) {
+    if (!child) {
+        return;
+    }
+    if (auto block = dynamic_cast<CollectableBlockBase*>(child.control_block_)) {
+        callback_(context_, block);
+    }
+}
+
+template <typename T>
+class CollectableControlBlock : public CollectableBlockBase,
+                                public BackendAllocated<CollectableControlBlock<T>, T> {
+public:
+    template <typename... Args>
+    CollectableControlBlock(Args&&... args) : counter_(1), weak_counter_(1) {
+        new (&buf_) T(std::forward<Args>(args)...);
+    }
+
+    void operator++() override {
+        ++counter_;
+        Owned();
+    }
+
+    // Losing an owner but staying alive is what makes a cycle candidate
+    int operator--() override {
+        int res = --counter_;
+        if (res > 0) {
+            PossibleRoot();
+        }
+        return res;
+    }
+
+    int WeakDecrement() override {
+        return --weak_counter_;
+    }
+
+    void WeakIncrement() override {
+        ++weak_counter_;
+    }
+
+    void IncrementBy(int n) override {
+        counter_ += n;
+        Owned();
+    }
+
+    void WeakIncrementBy(int n) override {
+        weak_counter_ += n;
+    }
+
+    bool TryIncrement() override {
+        if (!IncrementIfNonZero(counter_)) {
+            return false;
+        }
+        Owned();
+        return true;
+    }
+
+    T* Get() {
+        return reinterpret_cast<T*>(&buf_);
+    }
+
+    int GetCount() const override {
+        return counter_;
+    }
+
+    int GetWeakCount() const override {
+        return weak_counter_;
+    }
+
+    ~CollectableControlBlock() override = default;
+
+    void ObjectDelete() override {
+        SMART_POINTERS_PROBE(object_delete, T, Get());
+        Get()->~T();
+    }
+
+    TypeTag ObjectType() const override {
+        return kTypeTagOf<T>;
+    }
+
+    void VisitChildren(CycleVisitor& visitor) override {
+        CycleTraits<T>::Visit(*Get(), visitor);
+    }
+
+private:
+    RefCounter counter_;
+    RefCounter weak_counter_;
+    alignas(T) char buf_[sizeof(T)];
+};
+
+// `MakeShared` for objects whose cycles should be collected
+template <typename T, typename... Args>
+SharedPtr<T> MakeCollectable(Args&&... args) {
+    static_assert(!kCompactSharedFromThis<T>,
+                  "EnableCompactSharedFromThis objects are only owned through MakeShared");
+    CycleCollector::Instance().MaybeCollect();
+    SharedPtr<T> res;
+    auto block = new CollectableControlBlock<T>(std::forward<Args>(args)...);
+    res.control_block_ = block;
+    res.stored_ptr_ = block->Get();
+    if constexpr (std::is_convertible_v<T*, ESFTBase*>) {
+        res.InitWeakThis(res.stored_ptr_);
+    }
+    return res;
+}
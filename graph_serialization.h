@@ -0,0 +1,390 @@
+#pragma once
+
+#include "shared.h"
+#include "weak.h"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <exception>
+#include <istream>
+#include <ostream>
+#include <string>
+#include <type_traits>
+#include <typeinfo>
+#include <unordered_map>
+#include <vector>
+
+// Binary snapshots of object graphs built from `SharedPtr`s and `WeakPtr`s.
+//
+// Nodes are identified by their control block, so an object shared by many owners is written once
+// and comes back shared, cycles included. A type takes part by specializing `GraphTraits` with a
+// single function used both for writing and for reading:
+//
+//     template <>
+//     struct GraphTraits<Node> {
+//         template <typename Archive>
+//         static void Serialize(Archive& ar, Node& node) {
+//             ar(node.value, node.name, node.children, node.parent);
+//         }
+//     };
+//
+// Supported fields are arithmetic types and enums, `std::string`, `std::vector`, `SharedPtr`,
+// `WeakPtr` and other types with `GraphTraits`. A pointer must point to the object its control
+// block owns (no aliasing), and the node types must be default constructible. Every edge to a node
+// must have the same pointee type, up to `const`: an object held both as `SharedPtr<Base>` and as
+// `SharedPtr<Derived>` could not be rebuilt, so the writer throws `GraphTypeMismatch` on it.
+//
+// Format: the magic bytes "SPGR" and a format version, then a stream of unsigned LEB128 varints
+// and raw little-endian floating point numbers. Every edge is a node id, 0 standing for null, and
+// a previously unseen id is always the next one. Node bodies follow in id order, as soon as the
+// root they were discovered from is written, so both sides work in one pass with no seeking.
+//
+// On load each node is one `MakeShared` allocation. The reader keeps every node alive until it is
+// destroyed, then nodes nobody holds a strong reference to die, and `WeakPtr`s to them expire,
+// just like in the original graph.
+
+class BadGraphFormat : public std::exception {};
+
+// Thrown by `GraphWriter` when one node is reached through edges of different types. Whatever has
+// been written to the stream by then is not a valid graph.
+class GraphTypeMismatch : public std::exception {
+public:
+    const char* what() const noexcept override {
+        return "graph node is reached through pointers of different types";
+    }
+};
+
+template <typename T>
+struct GraphTraits;
+
+namespace graph_serialization_detail {
+
+template <typename T>
+struct IsVector : std::false_type {};
+
+template <typename T, typename A>
+struct IsVector<std::vector<T, A>> : std::true_type {};
+
+inline constexpr char kMagic[4] = {'S', 'P', 'G', 'R'};
+inline constexpr uint64_t kVersion = 1;
+
+}  // namespace graph_serialization_detail
+
+class GraphWriter {
+public:
+    explicit GraphWriter(std::ostream& out) : out_(out) {
+        out_.write(graph_serialization_detail::kMagic, sizeof(graph_serialization_detail::kMagic));
+        WriteVarint(graph_serialization_detail::kVersion);
+    }
+
+    GraphWriter(const GraphWriter&) = delete;
+    GraphWriter& operator=(const GraphWriter&) = delete;
+
+    // Writes the root and everything reachable from it which has not been written yet
+    template <typename T>
+    void Write(const SharedPtr<T>& root) {
+        WriteEdge(root);
+        while (written_ < pending_.size()) {
+            auto node = pending_[written_++];
+            node.write_body(*this, node.object);
+        }
+    }
+
+    template <typename... Args>
+    void operator()(Args&... args) {
+        (Process(args), ...);
+    }
+
+private:
+    struct Node {
+        void* object;
+        const std::type_info* type;
+        void (*write_body)(GraphWriter& writer, void* object);
+    };
+
+    template <typename T>
+    void Process(T& value) {
+        using namespace graph_serialization_detail;
+        using U = std::remove_const_t<T>;
+        if constexpr (std::is_same_v<U, bool>) {
+            WriteVarint(value ? 1 : 0);
+        } else if constexpr (std::is_enum_v<U>) {
+            WriteSigned(static_cast<int64_t>(value));
+        } else if constexpr (std::is_integral_v<U> && std::is_signed_v<U>) {
+            WriteSigned(value);
+        } else if constexpr (std::is_integral_v<U>) {
+            WriteVarint(value);
+        } else if constexpr (std::is_floating_point_v<U>) {
+            WriteRaw(value);
+        } else if constexpr (std::is_same_v<U, std::string>) {
+            WriteVarint(value.size());
+            out_.write(value.data(), static_cast<std::streamsize>(value.size()));
+        } else if constexpr (IsVector<U>::value) {
+            WriteVarint(value.size());
+            for (auto& element : value) {
+                Process(element);
+            }
+        } else {
+            GraphTraits<U>::Serialize(*this, const_cast<U&>(value));
+        }
+    }
+
+    template <typename T>
+    void Process(SharedPtr<T>& edge) {
+        WriteEdge(edge);
+    }
+
+    template <typename T>
+    void Process(const SharedPtr<T>& edge) {
+        WriteEdge(edge);
+    }
+
+    template <typename T>
+    void Process(WeakPtr<T>& edge) {
+        WriteEdge(edge.Lock());
+    }
+
+    template <typename T>
+    void Process(const WeakPtr<T>& edge) {
+        WriteEdge(edge.Lock());
+    }
+
+    template <typename T>
+    void WriteEdge(const SharedPtr<T>& edge) {
+        if (!edge) {
+            WriteVarint(0);
+            return;
+        }
+        using U = std::remove_const_t<T>;
+        auto [it, inserted] = ids_.emplace(edge.Block(), ids_.size() + 1);
+        if (inserted) {
+            pending_.push_back({const_cast<U*>(edge.Get()), &typeid(U),
+                                [](GraphWriter& writer, void* object) {
+                                    GraphTraits<U>::Serialize(writer, *static_cast<U*>(object));
+                                }});
+        } else if (*pending_[it->second - 1].type != typeid(U)) {
+            // The reader would reject it, better not to write what cannot be read back
+            throw GraphTypeMismatch();
+        }
+        WriteVarint(it->second);
+    }
+
+    void WriteVarint(uint64_t value) {
+        char buf[10];
+        size_t size = 0;
+        do {
+            buf[size] = static_cast<char>(value & 0x7f);
+            value >>= 7;
+            if (value) {
+                buf[size] |= static_cast<char>(0x80);
+            }
+            ++size;
+        } while (value);
+        out_.write(buf, static_cast<std::streamsize>(size));
+    }
+
+    // Zigzag, so that small negative numbers stay small
+    void WriteSigned(int64_t value) {
+        WriteVarint((static_cast<uint64_t>(value) << 1) ^ static_cast<uint64_t>(value >> 63));
+    }
+
+    template <typename T>
+    void WriteRaw(T value) {
+        char buf[sizeof(T)];
+        std::memcpy(buf, &value, sizeof(T));
+        if constexpr (kBigEndian) {
+            std::reverse(buf, buf + sizeof(T));
+        }
+        out_.write(buf, sizeof(T));
+    }
+
+    static constexpr bool kBigEndian = (__BYTE_ORDER__ == __ORDER_BIG_ENDIAN__);
+
+    std::ostream& out_;
+    std::unordered_map<const ControlBlock*, uint64_t> ids_;
+    std::vector<Node> pending_;
+    size_t written_ = 0;
+};
+
+class GraphReader {
+public:
+    // Throws `BadGraphFormat` unless the stream starts with what `GraphWriter` puts there
+    explicit GraphReader(std::istream& in) : in_(in) {
+        using namespace graph_serialization_detail;
+        char magic[sizeof(kMagic)];
+        ReadBytes(magic, sizeof(magic));
+        if (std::memcmp(magic, kMagic, sizeof(kMagic)) != 0 || ReadVarint() != kVersion) {
+            throw BadGraphFormat();
+        }
+    }
+
+    GraphReader(const GraphReader&) = delete;
+    GraphReader& operator=(const GraphReader&) = delete;
+
+    // Lets go of the nodes, the ones only referenced weakly die here
+    ~GraphReader() {
+        for (auto& node : nodes_) {
+            node.release(node.block, node.object);
+        }
+    }
+
+    // Reads a root written by `GraphWriter::Write<T>`, in the same order
+    template <typename T>
+    SharedPtr<T> Read() {
+        SharedPtr<T> root;
+        ReadEdge(root);
+        while (read_ < nodes_.size()) {
+            auto node = nodes_[read_++];
+            node.read_body(*this, node.object);
+        }
+        return root;
+    }
+
+    template <typename... Args>
+    void operator()(Args&... args) {
+        (Process(args), ...);
+    }
+
+private:
+    struct Node {
+        ControlBlock* block;
+        void* object;
+        const std::type_info* type;
+        void (*read_body)(GraphReader& reader, void* object);
+        void (*release)(ControlBlock* block, void* object);
+    };
+
+    template <typename T>
+    void Process(T& value) {
+        using namespace graph_serialization_detail;
+        if constexpr (std::is_same_v<T, bool>) {
+            value = (ReadVarint() != 0);
+        } else if constexpr (std::is_enum_v<T>) {
+            value = static_cast<T>(ReadSigned());
+        } else if constexpr (std::is_integral_v<T> && std::is_signed_v<T>) {
+            value = static_cast<T>(ReadSigned());
+        } else if constexpr (std::is_integral_v<T>) {
+            value = static_cast<T>(ReadVarint());
+        } else if constexpr (std::is_floating_point_v<T>) {
+            value = ReadRaw<T>();
+        } else if constexpr (std::is_same_v<T, std::string>) {
+            // Grow as the data actually arrives, a corrupted size must not make us allocate it all
+            auto size = ReadVarint();
+            value.clear();
+            while (value.size() < size) {
+                auto old_size = value.size();
+                value.resize(old_size + std::min<uint64_t>(size - old_size, kChunk));
+                ReadBytes(value.data() + old_size, value.size() - old_size);
+            }
+        } else if constexpr (IsVector<T>::value) {
+            auto size = ReadVarint();
+            value.clear();
+            value.reserve(std::min<uint64_t>(size, kChunk));
+            for (uint64_t i = 0; i < size; ++i) {
+                Process(value.emplace_back());
+            }
+        } else {
+            GraphTraits<T>::Serialize(*this, value);
+        }
+    }
+
+    template <typename T>
+    void Process(SharedPtr<T>& edge) {
+        ReadEdge(edge);
+    }
+
+    template <typename T>
+    void Process(WeakPtr<T>& edge) {
+        SharedPtr<T> strong;
+        ReadEdge(strong);
+        edge = strong;
+    }
+
+    template <typename T>
+    void ReadEdge(SharedPtr<T>& edge) {
+        using U = std::remove_const_t<T>;
+        auto id = ReadVarint();
+        if (id == 0) {
+            edge.Reset();
+            return;
+        }
+        if (id == nodes_.size() + 1) {
+            // First time we see it, the body comes later
+            auto fresh = MakeShared<U>();
+            nodes_.push_back({fresh.control_block_, fresh.Get(), &typeid(U), &ReadBody<U>,
+                              &Release<U>});
+            fresh.control_block_ = nullptr;
+            fresh.stored_ptr_ = nullptr;
+        } else if (id > nodes_.size()) {
+            throw BadGraphFormat();
+        }
+        auto& node = nodes_[id - 1];
+        if (*node.type != typeid(U)) {
+            throw BadGraphFormat();
+        }
+        SharedPtr<T> res;
+        res.control_block_ = node.block;
+        res.stored_ptr_ = static_cast<U*>(node.object);
+        node.block->operator++();
+        edge = std::move(res);
+    }
+
+    template <typename U>
+    static void ReadBody(GraphReader& reader, void* object) {
+        GraphTraits<U>::Serialize(reader, *static_cast<U*>(object));
+    }
+
+    template <typename U>
+    static void Release(ControlBlock* block, void* object) {
+        SharedPtr<U> owner;
+        owner.control_block_ = block;
+        owner.stored_ptr_ = static_cast<U*>(object);
+    }
+
+    uint64_t ReadVarint() {
+        uint64_t res = 0;
+        for (int shift = 0; shift < 64; shift += 7) {
+            auto byte = in_.get();
+            if (byte == std::istream::traits_type::eof()) {
+                throw BadGraphFormat();
+            }
+            res |= static_cast<uint64_t>(byte & 0x7f) << shift;
+            if (!(byte & 0x80)) {
+                return res;
+            }
+        }
+        throw BadGraphFormat();
+    }
+
+    int64_t ReadSigned() {
+        auto value = ReadVarint();
+        return static_cast<int64_t>(value >> 1) ^ -static_cast<int64_t>(value & 1);
+    }
+
+    void ReadBytes(char* data, size_t size) {
+        if (!in_.read(data, static_cast<std::streamsize>(size))) {
+            throw BadGraphFormat();
+        }
+    }
+
+    template <typename T>
+    T ReadRaw() {
+        char buf[sizeof(T)];
+        ReadBytes(buf, sizeof(T));
+        if constexpr (kBigEndian) {
+            std::reverse(buf, buf + sizeof(T));
+        }
+        T res;
+        std::memcpy(&res, buf, sizeof(T));
+        return res;
+    }
+
+    static constexpr bool kBigEndian = (__BYTE_ORDER__ == __ORDER_BIG_ENDIAN__);
+    static constexpr uint64_t kChunk = 1 << 16;
+
+    std::istream& in_;
+    std::vector<Node> nodes_;
+    size_t read_ = 0;
+};
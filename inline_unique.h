@@ -0,0 +1,269 @@
+#pragma once
+
+#include <cstddef>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+// Owning pointer to a polymorphic object which keeps small objects inside of itself.
+//
+// An object of up to `N` bytes and `Align` alignment with a non-throwing move constructor is
+// stored in the internal buffer, anything else goes to the heap, same as with `UniquePtr`. The
+// concrete type is erased into a static table of operations, so moving the pointer moves the
+// inline object into the new buffer (or just passes the heap pointer on), and the base does not
+// need a virtual destructor unless `Release` is used.
+
+inline constexpr size_t kDefaultInlineSize = 48;
+
+namespace inline_unique_detail {
+
+// Operations on the storage: either the object itself or a pointer to it
+struct Ops {
+    size_t size;
+    size_t align;
+    bool heap;
+    // Moves the object from `src` to `dst` storage, `src` is left empty
+    void (*relocate)(void* dst, void* src);
+    void (*destroy)(void* storage);
+    // Moves an inline object to the heap, `storage` is left empty
+    void* (*to_heap)(void* storage);
+    // Operations for the same type once it is on the heap
+    const Ops* heap_ops;
+};
+
+template <typename T>
+struct HeapOps {
+    static void Relocate(void* dst, void* src) {
+        *static_cast<void**>(dst) = *static_cast<void**>(src);
+    }
+
+    static void Destroy(void* storage) {
+        delete static_cast<T*>(*static_cast<void**>(storage));
+    }
+
+    static void* ToHeap(void* storage) {
+        return *static_cast<void**>(storage);
+    }
+
+    static constexpr Ops kOps = {sizeof(T),  alignof(T), true, &Relocate, &Destroy, &ToHeap,
+                                 nullptr};
+};
+
+template <typename T>
+struct InlineOps {
+    static void Relocate(void* dst, void* src) {
+        auto object = static_cast<T*>(src);
+        new (dst) T(std::move(*object));
+        object->~T();
+    }
+
+    static void Destroy(void* storage) {
+        static_cast<T*>(storage)->~T();
+    }
+
+    static void* ToHeap(void* storage) {
+        auto object = static_cast<T*>(storage);
+        auto res = new T(std::move(*object));
+        object->~T();
+        return res;
+    }
+
+    static constexpr Ops kOps = {sizeof(T),  alignof(T), false, &Relocate, &Destroy, &ToHeap,
+                                 &HeapOps<T>::kOps};
+};
+
+}  // namespace inline_unique_detail
+
+template <typename Base, size_t N = kDefaultInlineSize, size_t Align = alignof(std::max_align_t)>
+class InlineUniquePtr {
+    static_assert(N >= sizeof(void*) && Align >= alignof(void*), "the buffer must fit a pointer");
+
+    using Ops = inline_unique_detail::Ops;
+
+public:
+    template <typename T>
+    static constexpr bool kFitsInline = sizeof(T) <= N && alignof(T) <= Align &&
+                                        Align % alignof(T) == 0 &&
+                                        std::is_nothrow_move_constructible_v<T>;
+
+    ////////////////////////////////////////////////////////////////////////////////////////////////
+    // Constructors
+
+    InlineUniquePtr() : ptr_(nullptr), ops_(nullptr){};
+    InlineUniquePtr(std::nullptr_t) : ptr_(nullptr), ops_(nullptr){};
+
+    // Adopts a heap object, which is going to be deleted as `Base`
+    explicit InlineUniquePtr(Base* ptr) : ptr_(ptr), ops_(nullptr) {
+        if (ptr) {
+            *reinterpret_cast<void**>(&buf_) = ptr;
+            ops_ = &inline_unique_detail::HeapOps<Base>::kOps;
+        }
+    };
+
+    InlineUniquePtr(InlineUniquePtr&& other) noexcept : ptr_(nullptr), ops_(nullptr) {
+        MoveFrom(other);
+    }
+
+    template <typename Y, size_t M, size_t A,
+              std::enable_if_t<std::is_convertible_v<Y*, Base*>, int> = 0>
+    InlineUniquePtr(InlineUniquePtr<Y, M, A>&& other) : ptr_(nullptr), ops_(nullptr) {
+        MoveFrom(other);
+    }
+
+    ////////////////////////////////////////////////////////////////////////////////////////////////
+    // `operator=`-s
+
+    InlineUniquePtr& operator=(InlineUniquePtr&& other) noexcept {
+        if (this == &other) {
+            return *this;
+        }
+        Reset();
+        MoveFrom(other);
+        return *this;
+    }
+
+    template <typename Y, size_t M, size_t A,
+              std::enable_if_t<std::is_convertible_v<Y*, Base*>, int> = 0>
+    InlineUniquePtr& operator=(InlineUniquePtr<Y, M, A>&& other) {
+        Reset();
+        MoveFrom(other);
+        return *this;
+    }
+
+    InlineUniquePtr& operator=(std::nullptr_t) {
+        Reset();
+        return *this;
+    }
+
+    ////////////////////////////////////////////////////////////////////////////////////////////////
+    // Destructor
+
+    ~InlineUniquePtr() {
+        Reset();
+    }
+
+    ////////////////////////////////////////////////////////////////////////////////////////////////
+    // Modifiers
+
+    // Creates a `T` in place of the current object
+    template <typename T, typename... Args>
+    T& Emplace(Args&&... args) {
+        static_assert(std::is_convertible_v<T*, Base*>);
+        Reset();
+        T* object;
+        if constexpr (kFitsInline<T>) {
+            object = new (&buf_) T(std::forward<Args>(args)...);
+            ops_ = &inline_unique_detail::InlineOps<T>::kOps;
+        } else {
+            object = new T(std::forward<Args>(args)...);
+            *reinterpret_cast<void**>(&buf_) = object;
+            ops_ = &inline_unique_detail::HeapOps<T>::kOps;
+        }
+        ptr_ = object;
+        return *object;
+    }
+
+    // Gives up the object, moving it to the heap if it is inline. It is to be deleted as `Base`.
+    Base* Release() {
+        if (!ops_) {
+            return nullptr;
+        }
+        auto offset = Offset();
+        auto object = ops_->to_heap(&buf_);
+        auto res = reinterpret_cast<Base*>(static_cast<char*>(object) + offset);
+        ptr_ = nullptr;
+        ops_ = nullptr;
+        return res;
+    }
+
+    void Reset() {
+        if (ops_) {
+            auto ops = ops_;
+            ptr_ = nullptr;
+            ops_ = nullptr;
+            ops->destroy(&buf_);
+        }
+    }
+
+    void Reset(Base* ptr) {
+        InlineUniquePtr(ptr).Swap(*this);
+    }
+
+    void Swap(InlineUniquePtr& other) {
+        InlineUniquePtr tmp(std::move(other));
+        other = std::move(*this);
+        *this = std::move(tmp);
+    }
+
+    ////////////////////////////////////////////////////////////////////////////////////////////////
+    // Observers
+
+    Base* Get() const {
+        return ptr_;
+    }
+
+    Base& operator*() const {
+        return *Get();
+    }
+
+    Base* operator->() const {
+        return Get();
+    }
+
+    explicit operator bool() const {
+        return (Get() != nullptr);
+    }
+
+    bool IsInline() const {
+        return ops_ && !ops_->heap;
+    }
+
+private:
+    void* Object() const {
+        if (ops_->heap) {
+            return *reinterpret_cast<void* const*>(&buf_);
+        }
+        return const_cast<void*>(static_cast<const void*>(&buf_));
+    }
+
+    // The base is not necessarily at the start of the object, but always at the same distance
+    std::ptrdiff_t Offset() const {
+        return reinterpret_cast<const char*>(ptr_) - static_cast<const char*>(Object());
+    }
+
+    template <typename Y, size_t M, size_t A>
+    void MoveFrom(InlineUniquePtr<Y, M, A>& other) {
+        if (!other.ops_) {
+            return;
+        }
+        Base* converted = other.ptr_;
+        auto offset = reinterpret_cast<char*>(converted) - static_cast<char*>(other.Object());
+        auto ops = other.ops_;
+        if (!ops->heap && (ops->size > N || ops->align > Align || Align % ops->align != 0)) {
+            // Fitted there, does not fit here
+            *reinterpret_cast<void**>(&buf_) = ops->to_heap(&other.buf_);
+            ops = ops->heap_ops;
+        } else {
+            ops->relocate(&buf_, &other.buf_);
+        }
+        ops_ = ops;
+        ptr_ = reinterpret_cast<Base*>(static_cast<char*>(Object()) + offset);
+        other.ptr_ = nullptr;
+        other.ops_ = nullptr;
+    }
+
+    alignas(Align) unsigned char buf_[N];
+    Base* ptr_;
+    const Ops* ops_;
+
+    template <typename Y, size_t M, size_t A>
+    friend class InlineUniquePtr;
+};
+
+// `InlineUniquePtr<Base>` to a new `T`
+template <typename T, typename Base = T, size_t N = kDefaultInlineSize, typename... Args>
+InlineUniquePtr<Base, N> MakeInline(Args&&... args) {
+    InlineUniquePtr<Base, N> res;
+    res.template Emplace<T>(std::forward<Args>(args)...);
+    return res;
+}
@@ -0,0 +1,380 @@
+#pragma once
+
+#include <algorithm>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <string>
+#include <system_error>
+#include <type_traits>
+#include <utility>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Pointers for data that is built once into a file and then `mmap`-ed and used in place.
+//
+// `OffsetPtr` and `MappedUniquePtr` keep the distance from themselves to the pointee instead of an
+// address, so a structure made of them means the same wherever it is mapped. `MappedArena` builds
+// such a structure right inside a file, `MappedFile` maps it back read-only. There is nothing to
+// deserialize or fix up: pages are read in lazily by the kernel when they are first touched.
+//
+// Everything stored in the file must be trivially destructible and must not contain raw pointers
+// or virtual functions.
+
+// https://www.boost.org/doc/libs/release/doc/html/interprocess/offset_ptr.html
+template <typename T>
+class OffsetPtr {
+public:
+    ////////////////////////////////////////////////////////////////////////////////////////////////
+    // Constructors
+
+    OffsetPtr() : offset_(kNull){};
+    OffsetPtr(std::nullptr_t) : offset_(kNull){};
+    OffsetPtr(T* ptr) : offset_(OffsetTo(ptr)){};
+
+    // The distance has to be recomputed for the new location
+    OffsetPtr(const OffsetPtr& other) : offset_(OffsetTo(other.Get())){};
+
+    ////////////////////////////////////////////////////////////////////////////////////////////////
+    // `operator=`-s
+
+    OffsetPtr& operator=(const OffsetPtr& other) {
+        offset_ = OffsetTo(other.Get());
+        return *this;
+    }
+
+    OffsetPtr& operator=(T* ptr) {
+        offset_ = OffsetTo(ptr);
+        return *this;
+    }
+
+    ////////////////////////////////////////////////////////////////////////////////////////////////
+    // Observers
+
+    T* Get() const {
+        if (offset_ == kNull) {
+            return nullptr;
+        }
+        return reinterpret_cast<T*>(reinterpret_cast<std::intptr_t>(this) + offset_);
+    }
+
+    T& operator*() const {
+        return *Get();
+    }
+
+    T* operator->() const {
+        return Get();
+    }
+
+    T& operator[](size_t index) const {
+        return Get()[index];
+    }
+
+    explicit operator bool() const {
+        return (offset_ != kNull);
+    }
+
+private:
+    // Same as in Boost: one byte past `this` points into the `OffsetPtr` itself, nothing else can
+    // be there. Zero is a pointer to `this`, e.g. to the object it is the first member of.
+    static constexpr int64_t kNull = 1;
+
+    int64_t OffsetTo(const T* ptr) const {
+        if (!ptr) {
+            return kNull;
+        }
+        return reinterpret_cast<std::intptr_t>(ptr) - reinterpret_cast<std::intptr_t>(this);
+    }
+
+    int64_t offset_;
+};
+
+// `UniquePtr` whose pointee lives in a `MappedArena`. The arena owns the memory and gives it back
+// all at once, so releasing the pointee here is a no-op. `T` may be incomplete, to allow for trees.
+template <typename T>
+class MappedUniquePtr {
+public:
+    ////////////////////////////////////////////////////////////////////////////////////////////////
+    // Constructors
+
+    MappedUniquePtr() = default;
+    MappedUniquePtr(std::nullptr_t){};
+    explicit MappedUniquePtr(T* ptr) : ptr_(ptr){};
+
+    MappedUniquePtr(MappedUniquePtr&& other) : ptr_(other.Release()) {
+    }
+
+    ////////////////////////////////////////////////////////////////////////////////////////////////
+    // `operator=`-s
+
+    MappedUniquePtr& operator=(MappedUniquePtr&& other) {
+        if (this == &other) {
+            return *this;
+        }
+        Reset(other.Release());
+        return *this;
+    }
+
+    MappedUniquePtr& operator=(std::nullptr_t) {
+        Reset();
+        return *this;
+    }
+
+    ////////////////////////////////////////////////////////////////////////////////////////////////
+    // Modifiers
+
+    T* Release() {
+        auto res = Get();
+        ptr_ = nullptr;
+        return res;
+    }
+
+    void Reset(T* ptr = nullptr) {
+        ptr_ = ptr;
+    }
+
+    void Swap(MappedUniquePtr& other) {
+        T* ptr = Get();
+        ptr_ = other.Get();
+        other.ptr_ = ptr;
+    }
+
+    ////////////////////////////////////////////////////////////////////////////////////////////////
+    // Observers
+
+    T* Get() const {
+        return ptr_.Get();
+    }
+
+    T& operator*() const {
+        return *Get();
+    }
+
+    T* operator->() const {
+        return Get();
+    }
+
+    explicit operator bool() const {
+        return (Get() != nullptr);
+    }
+
+private:
+    OffsetPtr<T> ptr_;
+};
+
+namespace mapped_detail {
+
+// Version 2: offset 1 is null, it used to be 0
+inline constexpr uint64_t kMagic = 0x32504d4150504d53;  // "SMPPAMP2"
+
+struct Header {
+    uint64_t magic;
+    uint64_t size;
+    uint64_t root;
+    uint64_t root_size;
+};
+
+// Closes `fd` on the way out, if there is one
+[[noreturn]] inline void ThrowErrno(const char* what, int fd = -1) {
+    int error = errno;
+    if (fd >= 0) {
+        ::close(fd);
+    }
+    throw std::system_error(error, std::generic_category(), what);
+}
+
+}  // namespace mapped_detail
+
+// Bump allocator on top of a writable shared mapping of a file
+class MappedArena {
+public:
+    ////////////////////////////////////////////////////////////////////////////////////////////////
+    // Constructors
+
+    // Creates (or truncates) `path` with room for `capacity` bytes. The mapping never moves, so
+    // the capacity is fixed; the file is cut down to what has been used on `Finish`.
+    MappedArena(const std::string& path, size_t capacity)
+        : capacity_(capacity + sizeof(mapped_detail::Header)) {
+        fd_ = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (fd_ < 0) {
+            mapped_detail::ThrowErrno("open");
+        }
+        if (::ftruncate(fd_, static_cast<off_t>(capacity_)) != 0) {
+            mapped_detail::ThrowErrno("ftruncate", fd_);
+        }
+        auto base = ::mmap(nullptr, capacity_, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+        if (base == MAP_FAILED) {
+            mapped_detail::ThrowErrno("mmap", fd_);
+        }
+        base_ = static_cast<char*>(base);
+        used_ = sizeof(mapped_detail::Header);
+    };
+
+    MappedArena(const MappedArena&) = delete;
+    MappedArena& operator=(const MappedArena&) = delete;
+
+    ////////////////////////////////////////////////////////////////////////////////////////////////
+    // Destructor
+
+    ~MappedArena() {
+        if (base_) {
+            try {
+                Finish();
+            } catch (...) {
+            }
+        }
+    }
+
+    ////////////////////////////////////////////////////////////////////////////////////////////////
+    // Allocation
+
+    void* Allocate(size_t size, size_t alignment) {
+        size_t start = (used_ + alignment - 1) / alignment * alignment;
+        if (start + size > capacity_) {
+            throw std::bad_alloc();
+        }
+        used_ = start + size;
+        return base_ + start;
+    }
+
+    template <typename T, typename... Args>
+    T* New(Args&&... args) {
+        static_assert(std::is_trivially_destructible_v<T>, "mapped data is never destroyed");
+        return new (Allocate(sizeof(T), alignof(T))) T(std::forward<Args>(args)...);
+    }
+
+    // `n` value-initialized elements
+    template <typename T>
+    T* NewArray(size_t n) {
+        static_assert(std::is_trivially_destructible_v<T>, "mapped data is never destroyed");
+        return new (Allocate(sizeof(T) * n, alignof(T))) T[n]();
+    }
+
+    template <typename T, typename... Args>
+    MappedUniquePtr<T> MakeUnique(Args&&... args) {
+        return MappedUniquePtr<T>(New<T>(std::forward<Args>(args)...));
+    }
+
+    // The object `MappedFile::Root` gives back, must have been allocated here
+    template <typename T>
+    void SetRoot(const T* root) {
+        auto header = reinterpret_cast<mapped_detail::Header*>(base_);
+        header->root = static_cast<uint64_t>(reinterpret_cast<const char*>(root) - base_);
+        header->root_size = sizeof(T);
+    }
+
+    // Writes the header, trims the file and unmaps it. Pointers into the arena die here.
+    void Finish() {
+        auto header = reinterpret_cast<mapped_detail::Header*>(base_);
+        header->magic = mapped_detail::kMagic;
+        header->size = used_;
+        ::msync(base_, capacity_, MS_SYNC);
+        ::munmap(base_, capacity_);
+        base_ = nullptr;
+        if (::ftruncate(fd_, static_cast<off_t>(used_)) != 0) {
+            mapped_detail::ThrowErrno("ftruncate", fd_);
+        }
+        ::close(fd_);
+    }
+
+    ////////////////////////////////////////////////////////////////////////////////////////////////
+    // Observers
+
+    size_t Used() const {
+        return used_;
+    }
+
+private:
+    int fd_;
+    char* base_;
+    size_t capacity_;
+    size_t used_;
+};
+
+// Read-only mapping of a file built by `MappedArena`
+class MappedFile {
+public:
+    enum class Advice { kNormal, kSequential, kRandom, kWillNeed, kDontNeed };
+
+    ////////////////////////////////////////////////////////////////////////////////////////////////
+    // Constructors
+
+    explicit MappedFile(const std::string& path, Advice advice = Advice::kNormal) {
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            mapped_detail::ThrowErrno("open");
+        }
+        struct stat st;
+        if (::fstat(fd, &st) != 0) {
+            mapped_detail::ThrowErrno("fstat", fd);
+        }
+        size_ = static_cast<size_t>(st.st_size);
+        if (size_ < sizeof(mapped_detail::Header)) {
+            ::close(fd);
+            throw std::system_error(std::make_error_code(std::errc::invalid_argument), path);
+        }
+        // No MAP_POPULATE: pages are faulted in on first access
+        auto base = ::mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+        ::close(fd);
+        if (base == MAP_FAILED) {
+            mapped_detail::ThrowErrno("mmap");
+        }
+        base_ = static_cast<const char*>(base);
+
+        auto header = reinterpret_cast<const mapped_detail::Header*>(base_);
+        if (header->magic != mapped_detail::kMagic || header->size > size_ ||
+            header->root > header->size || header->root_size > header->size - header->root) {
+            ::munmap(const_cast<char*>(base_), size_);
+            throw std::system_error(std::make_error_code(std::errc::invalid_argument), path);
+        }
+        Advise(advice);
+    };
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    ////////////////////////////////////////////////////////////////////////////////////////////////
+    // Destructor
+
+    ~MappedFile() {
+        ::munmap(const_cast<char*>(base_), size_);
+    }
+
+    ////////////////////////////////////////////////////////////////////////////////////////////////
+    // Access
+
+    template <typename T>
+    const T& Root() const {
+        auto header = reinterpret_cast<const mapped_detail::Header*>(base_);
+        if (header->root == 0 || header->root_size != sizeof(T)) {
+            throw std::system_error(std::make_error_code(std::errc::invalid_argument), "root");
+        }
+        return *reinterpret_cast<const T*>(base_ + header->root);
+    }
+
+    // Hint for the kernel about how a range of the file is going to be accessed
+    void Advise(Advice advice, size_t offset = 0, size_t length = 0) {
+        static constexpr int kFlags[] = {MADV_NORMAL, MADV_SEQUENTIAL, MADV_RANDOM, MADV_WILLNEED,
+                                         MADV_DONTNEED};
+        auto page = static_cast<size_t>(::sysconf(_SC_PAGESIZE));
+        offset = std::min(offset, size_);
+        auto start = offset / page * page;
+        if (length == 0 || offset + length > size_) {
+            length = size_ - offset;
+        }
+        ::madvise(const_cast<char*>(base_) + start, length + (offset - start),
+                  kFlags[static_cast<int>(advice)]);
+    }
+
+    size_t Size() const {
+        return size_;
+    }
+
+private:
+    const char* base_;
+    size_t size_;
+};
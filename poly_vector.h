@@ -0,0 +1,379 @@
+#pragma once
+
+#include "allocation.h"
+#include "unique.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+// Owning container of polymorphic objects, a packed alternative to `std::vector<UniquePtr<Base>>`.
+//
+// Objects are grouped by their concrete type, every type gets one contiguous array of its own.
+// Iteration goes type by type, so virtual calls in a loop over the container keep hitting the same
+// target and the objects are read sequentially instead of being chased through pointers. The
+// memory comes from the allocation backend of `Base`.
+//
+// Like `std::vector`: `Emplace` may move the objects of its type to a new array, `Erase` moves the
+// last object of the type into the hole, and both invalidate iterators and references. The types
+// have to be nothrow move constructible for this, same as for `InlineUniquePtr` to keep them
+// inline: a move failing halfway through an array would leave it half destroyed. The order of
+// objects is only kept within one type.
+//
+// `Extract` moves an object out into a `UniquePtr` of its own, whose deleter knows the concrete
+// type, so `Base` does not need a virtual destructor.
+
+// Deleter of extracted objects. A default-constructed one is only good for empty pointers.
+template <typename Base>
+class PolyDeleter {
+public:
+    constexpr PolyDeleter() = default;
+
+    explicit constexpr PolyDeleter(void (*destroy)(Base*)) : destroy_(destroy){};
+
+    void operator()(Base* ptr) const {
+        destroy_(ptr);
+    }
+
+private:
+    void (*destroy_)(Base*) = nullptr;
+};
+
+namespace poly_vector_detail {
+
+// Operations on an array of one concrete type
+template <typename Base>
+struct Ops {
+    size_t size;
+    size_t align;
+    // Moves `count` objects from `src` to `dst`, the old ones are destroyed
+    void (*relocate)(void* dst, void* src, size_t count);
+    // `nullptr` for trivially destructible types
+    void (*destroy)(void* objects, size_t count);
+    // Moves the object to the heap, the old one is destroyed
+    Base* (*extract)(void* object);
+    // Deletes an extracted object
+    void (*delete_extracted)(Base* ptr);
+};
+
+template <typename Base, typename T>
+struct TypedOps {
+    static void Relocate(void* dst, void* src, size_t count) {
+        auto from = static_cast<T*>(src);
+        auto to = static_cast<T*>(dst);
+        for (size_t i = 0; i < count; ++i) {
+            new (to + i) T(std::move(from[i]));
+            from[i].~T();
+        }
+    }
+
+    static void Destroy(void* objects, size_t count) {
+        auto array = static_cast<T*>(objects);
+        for (size_t i = 0; i < count; ++i) {
+            array[i].~T();
+        }
+    }
+
+    static Base* Extract(void* object) {
+        auto old = static_cast<T*>(object);
+        auto res = New<T>(std::move(*old));
+        old->~T();
+        return res;
+    }
+
+    static void DeleteExtracted(Base* ptr) {
+        Delete(static_cast<T*>(ptr));
+    }
+
+    static constexpr Ops<Base> kOps = {
+        sizeof(T),
+        alignof(T),
+        &Relocate,
+        std::is_trivially_destructible_v<T> ? nullptr : &Destroy,
+        &Extract,
+        &DeleteExtracted,
+    };
+};
+
+}  // namespace poly_vector_detail
+
+template <typename Base>
+class PolyVector {
+    using Ops = poly_vector_detail::Ops<Base>;
+
+    struct Group {
+        const Ops* ops;
+        unsigned char* data;
+        size_t size;
+        size_t capacity;
+        // Where `Base` is in the objects, the same for all of them
+        ptrdiff_t base_offset;
+
+        Base* At(size_t index) const {
+            return reinterpret_cast<Base*>(data + index * ops->size + base_offset);
+        }
+    };
+
+public:
+    using Owner = UniquePtr<Base, PolyDeleter<Base>>;
+
+    template <bool Const>
+    class Iterator {
+        using Container = std::conditional_t<Const, const PolyVector, PolyVector>;
+
+    public:
+        using iterator_category = std::forward_iterator_tag;
+        using value_type = Base;
+        using difference_type = ptrdiff_t;
+        using reference = std::conditional_t<Const, const Base&, Base&>;
+        using pointer = std::conditional_t<Const, const Base*, Base*>;
+
+        Iterator() = default;
+
+        template <bool C = Const, std::enable_if_t<C, int> = 0>
+        Iterator(const Iterator<false>& other)
+            : container_(other.container_), group_(other.group_), index_(other.index_){};
+
+        reference operator*() const {
+            return *container_->groups_[group_].At(index_);
+        }
+
+        pointer operator->() const {
+            return container_->groups_[group_].At(index_);
+        }
+
+        Iterator& operator++() {
+            ++index_;
+            SkipEmpty();
+            return *this;
+        }
+
+        Iterator operator++(int) {
+            auto res = *this;
+            ++*this;
+            return res;
+        }
+
+        bool operator==(const Iterator& other) const {
+            return group_ == other.group_ && index_ == other.index_;
+        }
+
+    private:
+        Iterator(Container* container, size_t group, size_t index)
+            : container_(container), group_(group), index_(index) {
+            SkipEmpty();
+        }
+
+        void SkipEmpty() {
+            auto& groups = container_->groups_;
+            while (group_ < groups.size() && index_ == groups[group_].size) {
+                ++group_;
+                index_ = 0;
+            }
+        }
+
+        Container* container_ = nullptr;
+        size_t group_ = 0;
+        size_t index_ = 0;
+
+        friend class PolyVector;
+        friend class Iterator<true>;
+    };
+
+    using iterator = Iterator<false>;
+    using const_iterator = Iterator<true>;
+
+    ////////////////////////////////////////////////////////////////////////////////////////////////
+    // Constructors
+
+    PolyVector() = default;
+
+    PolyVector(PolyVector&& other) noexcept
+        : groups_(std::move(other.groups_)), size_(std::exchange(other.size_, 0)){};
+
+    PolyVector& operator=(PolyVector&& other) noexcept {
+        if (this != &other) {
+            Free();
+            groups_ = std::move(other.groups_);
+            size_ = std::exchange(other.size_, 0);
+        }
+        return *this;
+    }
+
+    ////////////////////////////////////////////////////////////////////////////////////////////////
+    // Destructor
+
+    ~PolyVector() {
+        Free();
+    }
+
+    ////////////////////////////////////////////////////////////////////////////////////////////////
+    // Modifiers
+
+    template <typename T, typename... Args>
+    T& Emplace(Args&&... args) {
+        static_assert(std::is_convertible_v<T*, Base*>, "T has to be derived from Base");
+        static_assert(std::is_nothrow_move_constructible_v<T>,
+                      "objects are moved when their array grows and must not throw doing it");
+
+        auto& group = GroupOf<T>();
+        if (group.size == group.capacity) {
+            Grow(group);
+        }
+        auto object = new (group.data + group.size * sizeof(T)) T(std::forward<Args>(args)...);
+        // The same for every `T`, but computing it takes a real object
+        group.base_offset = reinterpret_cast<unsigned char*>(static_cast<Base*>(object)) -
+                            reinterpret_cast<unsigned char*>(object);
+        ++group.size;
+        ++size_;
+        return *object;
+    }
+
+    // Returns the iterator to the next object
+    iterator Erase(const_iterator pos) {
+        auto& group = groups_[pos.group_];
+        auto object = Object(group, pos.index_);
+        if (group.ops->destroy) {
+            group.ops->destroy(object, 1);
+        }
+        FillHole(group, pos.index_);
+        return iterator(this, pos.group_, pos.index_);
+    }
+
+    // Moves the object out into its own allocation and erases it from the container
+    Owner Extract(const_iterator pos) {
+        auto& group = groups_[pos.group_];
+        Owner res(group.ops->extract(Object(group, pos.index_)),
+                  PolyDeleter<Base>(group.ops->delete_extracted));
+        FillHole(group, pos.index_);
+        return res;
+    }
+
+    // Destroys all the objects, a whole array at a time, and keeps the memory
+    void Clear() {
+        for (auto& group : groups_) {
+            if (group.ops->destroy) {
+                group.ops->destroy(group.data, group.size);
+            }
+            group.size = 0;
+        }
+        size_ = 0;
+    }
+
+    ////////////////////////////////////////////////////////////////////////////////////////////////
+    // Iteration
+
+    iterator begin() {
+        return iterator(this, 0, 0);
+    }
+
+    iterator end() {
+        return iterator(this, groups_.size(), 0);
+    }
+
+    const_iterator begin() const {
+        return const_iterator(this, 0, 0);
+    }
+
+    const_iterator end() const {
+        return const_iterator(this, groups_.size(), 0);
+    }
+
+    // `f(Base&)` for all objects
+    template <typename F>
+    void ForEach(F&& f) {
+        for (auto& group : groups_) {
+            for (size_t i = 0; i < group.size; ++i) {
+                f(*group.At(i));
+            }
+        }
+    }
+
+    // `f(T&)` for the objects of exactly type `T`, the calls need no dispatch at all
+    template <typename T, typename F>
+    void ForEachOf(F&& f) {
+        for (auto& group : groups_) {
+            if (group.ops == &poly_vector_detail::TypedOps<Base, T>::kOps) {
+                auto objects = reinterpret_cast<T*>(group.data);
+                for (size_t i = 0; i < group.size; ++i) {
+                    f(objects[i]);
+                }
+                return;
+            }
+        }
+    }
+
+    ////////////////////////////////////////////////////////////////////////////////////////////////
+    // Observers
+
+    size_t Size() const {
+        return size_;
+    }
+
+    bool Empty() const {
+        return size_ == 0;
+    }
+
+    // Number of concrete types seen so far
+    size_t Groups() const {
+        return groups_.size();
+    }
+
+private:
+    static void* Object(const Group& group, size_t index) {
+        return group.data + index * group.ops->size;
+    }
+
+    // A handful of types is the usual case, a linear search beats hashing there
+    template <typename T>
+    Group& GroupOf() {
+        const Ops* ops = &poly_vector_detail::TypedOps<Base, T>::kOps;
+        for (auto& group : groups_) {
+            if (group.ops == ops) {
+                return group;
+            }
+        }
+        groups_.push_back({ops, nullptr, 0, 0, 0});
+        return groups_.back();
+    }
+
+    void Grow(Group& group) {
+        size_t capacity = group.capacity == 0 ? 4 : group.capacity * 2;
+        auto data = static_cast<unsigned char*>(
+            AllocationBackend<Base>::Allocate(capacity * group.ops->size, group.ops->align));
+        if (group.data) {
+            group.ops->relocate(data, group.data, group.size);
+            AllocationBackend<Base>::Deallocate(group.data, group.capacity * group.ops->size,
+                                                group.ops->align);
+        }
+        group.data = data;
+        group.capacity = capacity;
+    }
+
+    // The object at `index` is gone, the last one takes its place
+    void FillHole(Group& group, size_t index) {
+        --group.size;
+        --size_;
+        if (index != group.size) {
+            group.ops->relocate(Object(group, index), Object(group, group.size), 1);
+        }
+    }
+
+    void Free() {
+        Clear();
+        for (auto& group : groups_) {
+            if (group.data) {
+                AllocationBackend<Base>::Deallocate(group.data, group.capacity * group.ops->size,
+                                                    group.ops->align);
+            }
+        }
+        groups_.clear();
+    }
+
+    std::vector<Group> groups_;
+    size_t size_ = 0;
+};
@@ -0,0 +1,270 @@
+#pragma once
+
+#include "shared.h"
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+// `MakeShared` for a few very hot objects (current config, schema, metrics registry...) which
+// every thread keeps copying. The strong count of such an object is split into stripes, one cache
+// line each, and threads copy and release through their own stripe.
+//
+// A stripe holds a budget of references bought from the central count in batches: a copy spends
+// one from the budget, a release puts one back, and only every `kBatch`-th operation touches the
+// central count. So the central count is the number of owners plus all the unspent budgets, and
+// since a budget never reaches `3 * kBatch`, a central count above `kThreshold` proves that the
+// object is alive. Once it drops below, the stripes are closed, their budgets are returned and
+// the block works with the exact central count like any other one, until the object becomes
+// popular again. Objects with few owners never leave that central mode.
+//
+// Needs `SMART_POINTERS_THREADED` to be of any use, the rest of the library is not thread-safe
+// without it.
+
+template <typename T>
+class ShardedControlBlock : public ControlBlock,
+                            public BackendAllocated<ShardedControlBlock<T>, T> {
+public:
+    static constexpr int kStripes = 16;
+    static constexpr int kBatch = 4;
+    static constexpr int kThreshold = kStripes * 3 * kBatch;
+    // Hysteresis, not to switch back and forth around the threshold
+    static constexpr int kEnableAt = 2 * kThreshold;
+
+    template <typename... Args>
+    ShardedControlBlock(Args&&... args) : counter_(1), weak_counter_(1), sharded_(false) {
+        new (&buf_) T(std::forward<Args>(args)...);
+    }
+
+    void operator++() override {
+        auto& stripe = Stripe();
+        auto budget = stripe.load();
+        while (true) {
+            if (budget == kClosed) {
+                AddCentral(1);
+                return;
+            }
+            if (budget > 0) {
+                if (stripe.compare_exchange_weak(budget, budget - 1)) {
+                    return;
+                }
+                continue;
+            }
+            // Buy a batch: one for us, the rest for the stripe
+            counter_ += kBatch;
+            while (true) {
+                if (budget == kClosed || budget >= 2 * kBatch) {
+                    // Closed or refilled by someone else meanwhile, the rest goes back
+                    if ((counter_ -= kBatch - 1) <= kThreshold && sharded_) {
+                        Close();
+                    }
+                    return;
+                }
+                if (stripe.compare_exchange_weak(budget, budget + kBatch - 1)) {
+                    return;
+                }
+            }
+        }
+    }
+
+    // While sharded the new value is unknown; anything positive means "not the last one".
+    int operator--() override {
+        auto& stripe = Stripe();
+        auto budget = stripe.load();
+        while (true) {
+            if (budget == kClosed) {
+                return CentralDecrement();
+            }
+            if (budget < 2 * kBatch) {
+                if (stripe.compare_exchange_weak(budget, budget + 1)) {
+                    return 1;
+                }
+                continue;
+            }
+            // Enough budget, give a batch back
+            if (stripe.compare_exchange_weak(budget, budget + 1 - kBatch)) {
+                // Zero already if somebody is closing the stripes right now
+                int count = (counter_ -= kBatch);
+                if (count == 0 || (count <= kThreshold && Close())) {
+                    return 0;
+                }
+                return 1;
+            }
+        }
+    }
+
+    int WeakDecrement() override {
+        return --weak_counter_;
+    }
+
+    void WeakIncrement() override {
+        ++weak_counter_;
+    }
+
+    void IncrementBy(int n) override {
+        AddCentral(n);
+    }
+
+    void WeakIncrementBy(int n) override {
+        weak_counter_ += n;
+    }
+
+    bool TryIncrement() override {
+        auto count = counter_.load();
+        while (count > kThreshold) {
+            if (counter_.compare_exchange_weak(count, count + 1)) {
+                return true;
+            }
+        }
+        // Might be dead: count exactly
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (!CloseLocked()) {
+                int value = counter_.load();
+                while (value != 0) {
+                    if (counter_.compare_exchange_weak(value, value + 1)) {
+                        return true;
+                    }
+                }
+                return false;
+            }
+        }
+        // The last owner left its reference in a stripe, so burying the object is on us
+        Expire();
+        ObjectDelete();
+        if (WeakDecrement() == 0) {
+            BlockDelete();
+        }
+        return false;
+    }
+
+    T* Get() {
+        return reinterpret_cast<T*>(&buf_);
+    }
+
+    // Exact unless sharded. Then it is an estimate, but never a false 1, as the destructor of
+    // `SharedPtr` relies on that: the central count alone is always an upper bound.
+    int GetCount() const override {
+        int central = counter_.load();
+        if (!sharded_.load()) {
+            return central;
+        }
+        int res = central;
+        for (auto& stripe : stripes_) {
+            auto budget = stripe.budget.load();
+            if (budget != kClosed) {
+                res -= static_cast<int>(budget);
+            }
+        }
+        return (res > 1 ? res : central);
+    }
+
+    int GetWeakCount() const override {
+        return weak_counter_;
+    }
+
+    bool IsSharded() const {
+        return sharded_;
+    }
+
+    ~ShardedControlBlock() override = default;
+
+    void ObjectDelete() override {
+        SMART_POINTERS_PROBE(object_delete, T, Get());
+        Get()->~T();
+    }
+
+    TypeTag ObjectType() const override {
+        return kTypeTagOf<T>;
+    }
+
+private:
+    static constexpr int64_t kClosed = -1;
+
+    struct alignas(64) PaddedStripe {
+        std::atomic<int64_t> budget{kClosed};
+    };
+
+    static int ThreadStripe() {
+        static std::atomic<int> next = 0;
+        static thread_local int index = next++ % kStripes;
+        return index;
+    }
+
+    std::atomic<int64_t>& Stripe() {
+        return stripes_[ThreadStripe()].budget;
+    }
+
+    void AddCentral(int n) {
+        if ((counter_ += n) > kEnableAt && !sharded_) {
+            Open();
+        }
+    }
+
+    // Only while closed, or while the stripes are being opened
+    int CentralDecrement() {
+        int res = --counter_;
+        if (res != 0 && res <= kThreshold && sharded_ && Close()) {
+            return 0;
+        }
+        return res;
+    }
+
+    void Open() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (sharded_ || counter_ <= kEnableAt) {
+            return;
+        }
+        for (auto& stripe : stripes_) {
+            stripe.budget = 0;
+        }
+        sharded_ = true;
+    }
+
+    // Returns whether the count has dropped to zero on the way
+    bool Close() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return CloseLocked();
+    }
+
+    bool CloseLocked() {
+        if (!sharded_) {
+            return false;
+        }
+        sharded_ = false;
+        bool dead = false;
+        for (auto& stripe : stripes_) {
+            auto budget = stripe.budget.exchange(kClosed);
+            if (budget > 0 && (counter_ -= static_cast<int>(budget)) == 0) {
+                dead = true;
+            }
+        }
+        return dead;
+    }
+
+    std::atomic<int> counter_;
+    std::atomic<int> weak_counter_;
+    std::atomic<bool> sharded_;
+    std::mutex mutex_;
+    PaddedStripe stripes_[kStripes];
+    alignas(T) char buf_[sizeof(T)];
+};
+
+// `MakeShared` with a sharded reference count
+template <typename T, typename... Args>
+SharedPtr<T> MakeShardedShared(Args&&... args) {
+    static_assert(!kCompactSharedFromThis<T>,
+                  "EnableCompactSharedFromThis objects are only owned through MakeShared");
+    SharedPtr<T> res;
+    auto block = new ShardedControlBlock<T>(std::forward<Args>(args)...);
+    res.control_block_ = block;
+    res.stored_ptr_ = block->Get();
+    if constexpr (std::is_convertible_v<T*, ESFTBase*>) {
+        res.InitWeakThis(res.stored_ptr_);
+    }
+    return res;
+}
@@ -1,9 +1,17 @@
 #pragma once
 
 #include "sw_fwd.h"  // Forward declaration
+#include "unique.h"
 
+#include <algorithm>
+#include <atomic>
+#include <cassert>
 #include <cstddef>  // std::nullptr_t
+#include <functional>
+#include <span>
 #include <type_traits>
+#include <utility>
+#include <vector>
 
 // https://en.cppreference.com/w/cpp/memory/shared_ptr
 template <typename T>
@@ -14,14 +22,21 @@ public:
 
     SharedPtr() : stored_ptr_(nullptr), control_block_(nullptr){};
     SharedPtr(std::nullptr_t) : stored_ptr_(nullptr), control_block_(nullptr){};
-    explicit SharedPtr(T* ptr) : stored_ptr_(ptr), control_block_(new PointerControlBlock<T>(ptr)) {
+    explicit SharedPtr(T* ptr) : stored_ptr_(ptr), control_block_(nullptr) {
+        static_assert(!std::is_void_v<T>, "the object cannot be deleted through `void*`");
+        static_assert(!kCompactSharedFromThis<T>,
+                      "EnableCompactSharedFromThis objects are only owned through MakeShared");
+        // Lazy: no block until somebody else needs it, see `Block`
+        if constexpr (kLazyBlocks && !std::is_convertible_v<T*, ESFTBase*>) {
+            return;
+        }
+        control_block_ = new PointerControlBlock<T>(ptr);
         if constexpr (std::is_convertible_v<T*, ESFTBase*>) {
             InitWeakThis(ptr);
         }
     };
 
-    SharedPtr(const SharedPtr& other)
-        : stored_ptr_(other.Get()), control_block_(other.control_block_) {
+    SharedPtr(const SharedPtr& other) : stored_ptr_(other.Get()), control_block_(other.Block()) {
         if (operator bool()) {
             control_block_->operator++();
         }
@@ -36,51 +51,84 @@ public:
     // #8 from https://en.cppreference.com/w/cpp/memory/shared_ptr/shared_ptr
     template <typename Y>
     SharedPtr(const SharedPtr<Y>& other, T* ptr)
-        : stored_ptr_(ptr), control_block_(other.control_block_) {  // implicit conversion
+        : stored_ptr_(ptr), control_block_(other.Block()) {  // implicit conversion
         if (operator bool()) {
             control_block_->operator++();
         }
     }
 
     template <typename Y>
-    SharedPtr(SharedPtr<Y>&& other, T* ptr)
-        : stored_ptr_(ptr), control_block_(other.control_block_) {
+    SharedPtr(SharedPtr<Y>&& other, T* ptr) : stored_ptr_(ptr), control_block_(other.Block()) {
         other.stored_ptr_ = nullptr;
         other.control_block_ = nullptr;
     }
 
     template <typename Y>
     SharedPtr(const SharedPtr<Y>& other)
-        : stored_ptr_(other.Get()), control_block_(other.control_block_) {
+        : stored_ptr_(other.Get()), control_block_(other.Block()) {
         if (operator bool()) {
             control_block_->operator++();
         }
     };
 
+    // A lazy `other` gets its block here, after the conversion the type to delete would be lost
     template <typename Y>
-    SharedPtr(SharedPtr<Y>&& other)
-        : stored_ptr_(other.Get()), control_block_(other.control_block_) {
+    SharedPtr(SharedPtr<Y>&& other) : stored_ptr_(other.Get()), control_block_(other.Block()) {
         other.stored_ptr_ = nullptr;
         other.control_block_ = nullptr;
     };
 
     template <typename Y>
     SharedPtr(Y* ptr) : stored_ptr_(ptr), control_block_(new PointerControlBlock<Y>(ptr)) {
+        static_assert(!kCompactSharedFromThis<Y>,
+                      "EnableCompactSharedFromThis objects are only owned through MakeShared");
         if constexpr (std::is_convertible_v<T*, ESFTBase*>) {
             InitWeakThis(stored_ptr_);
         }
     };
 
+    // Takes over a `UniquePtr` together with its deleter
+    template <typename Y, typename D>
+    SharedPtr(UniquePtr<Y, D>&& other) : stored_ptr_(nullptr), control_block_(nullptr) {
+        static_assert(!kCompactSharedFromThis<Y>,
+                      "EnableCompactSharedFromThis objects are only owned through MakeShared");
+        if (other) {
+            control_block_ =
+                new DeleterControlBlock<Y, D>(other.Get(), std::move(other.GetDeleter()));
+            stored_ptr_ = other.Release();
+            if constexpr (std::is_convertible_v<T*, ESFTBase*>) {
+                InitWeakThis(stored_ptr_);
+            }
+        }
+    }
+
+    // From `MakeUniqueShareable`: the control block is already there
+    template <typename Y>
+    SharedPtr(UniquePtr<Y, ShareableDeleter>&& other)
+        : stored_ptr_(nullptr), control_block_(nullptr) {
+        if (other) {
+            auto block = std::exchange(other.GetDeleter().block_, nullptr);
+            if (block) {
+                block->operator++();
+                control_block_ = block;
+            } else {
+                // Adopted from plain `new`, no block to reuse
+                control_block_ = new PointerControlBlock<Y>(other.Get());
+            }
+            stored_ptr_ = other.Release();
+            if constexpr (std::is_convertible_v<T*, ESFTBase*>) {
+                InitWeakThis(stored_ptr_);
+            }
+        }
+    }
+
     // Promote `WeakPtr`
     // #11 from https://en.cppreference.com/w/cpp/memory/shared_ptr/shared_ptr
     explicit SharedPtr(const WeakPtr<T>& other)
         : stored_ptr_(other.stored_ptr_), control_block_(other.control_block_) {
-        if (other.Expired()) {
+        if (!control_block_ || !control_block_->TryIncrement()) {
             throw BadWeakPtr();
         }
-        if (operator bool()) {
-            control_block_->operator++();
-        }
     }
 
     ////////////////////////////////////////////////////////////////////////////////////////////////
@@ -109,14 +157,31 @@ public:
 
     ~SharedPtr() {
         if (operator bool()) {
-            if (UseCount() == 1 && WeakCount() == 0) {
+            if constexpr (kLazyBlocks && !std::is_void_v<T>) {
+                if (!control_block_) {
+                    SMART_POINTERS_PROBE(object_delete, T, stored_ptr_);
+                    delete stored_ptr_;
+                    return;
+                }
+            }
+#ifndef SMART_POINTERS_THREADED
+            // Sole owner and no one watching: skip the decrements. Not in threaded builds: the two
+            // counts are read separately, and a `WeakPtr::Lock` on another thread may take a new
+            // owner and drop its `WeakPtr` in between, so both reads can see 1 while the object is
+            // still in use.
+            if (UseCount() == 1 && WeakCount() == 1) {
+                control_block_->Expire();
                 control_block_->ObjectDelete();
-                delete control_block_;
+                control_block_->BlockDelete();
                 control_block_ = nullptr;
-            } else {
-                control_block_->operator--();
-                if (UseCount() == 0) {
-                    control_block_->ObjectDelete();
+                return;
+            }
+#endif
+            if (control_block_->operator--() == 0) {
+                control_block_->Expire();
+                control_block_->ObjectDelete();
+                if (control_block_->WeakDecrement() == 0) {
+                    control_block_->BlockDelete();
                 }
             }
         }
@@ -141,6 +206,44 @@ public:
         std::swap(control_block_, other.control_block_);
     }
 
+    ////////////////////////////////////////////////////////////////////////////////////////////////
+    // Bulk sharing
+    // Same as writing `n` copies to `out`, but the control block is updated only once. Throws
+    // `std::length_error` if `n` does not fit into the counter.
+
+    template <typename OutputIt>
+    OutputIt ShareN(size_t n, OutputIt out) const {
+        if (operator bool() && n > 0) {
+            Block()->IncrementBy(BulkCount(n));
+        }
+        size_t written = 0;
+        try {
+            for (; written < n; ++written) {
+                SharedPtr<T> copy;
+                copy.stored_ptr_ = stored_ptr_;
+                copy.control_block_ = control_block_;
+                *out = std::move(copy);
+                ++out;
+            }
+        } catch (...) {
+            // Give back the references nobody has got. The one that failed to be written is
+            // already taken care of by `copy`.
+            for (++written; written < n; ++written) {
+                SharedPtr<T> copy;
+                copy.stored_ptr_ = stored_ptr_;
+                copy.control_block_ = control_block_;
+            }
+            throw;
+        }
+        return out;
+    }
+
+    // `n` `WeakPtr`s, needs weak.h
+    template <typename OutputIt>
+    OutputIt ShareWeakN(size_t n, OutputIt out) const {
+        return WeakPtr<T>(*this).ShareN(n, out);
+    }
+
     ////////////////////////////////////////////////////////////////////////////////////////////////
     // Observers
 
@@ -148,7 +251,8 @@ public:
         return stored_ptr_;
     }
 
-    T& operator*() const {
+    // `void` for `SharedPtr<void>`, which is fine as long as nobody dereferences it
+    std::add_lvalue_reference_t<T> operator*() const {
         return *Get();
     }
 
@@ -160,13 +264,57 @@ public:
         if (!operator bool()) {
             return 0;
         }
-        return control_block_->GetCount();
+        auto block = LoadBlock();
+        // No block means a lazy pointer, which is alone by definition
+        return block ? block->GetCount() : 1;
     }
 
     explicit operator bool() const {
         return (Get() != nullptr);
     }
 
+    // Whether the object was created as (or adopted as a pointer to) `Y`. Says nothing about
+    // where an aliasing pointer points to.
+    template <typename Y>
+    bool Holds() const {
+        if (!operator bool()) {
+            return false;
+        }
+        // No block means a lazy pointer, adopted as a `T*`
+        auto block = LoadBlock();
+        return (block ? block->ObjectType() : kTypeTagOf<T>) == kTypeTagOf<Y>;
+    }
+
+    ////////////////////////////////////////////////////////////////////////////////////////////////
+    // Owner-based comparison
+    // By control block instead of the stored pointer: aliases of one object are equal, and a
+    // `WeakPtr` keeps its place after the object has expired. A lazy pointer gets its block here,
+    // so that its key stays the same once it is copied.
+
+    template <typename Y>
+    bool OwnerBefore(const SharedPtr<Y>& other) const {
+        return std::less<const void*>()(OwnerKey(), other.OwnerKey());
+    }
+
+    template <typename Y>
+    bool OwnerBefore(const WeakPtr<Y>& other) const {
+        return std::less<const void*>()(OwnerKey(), other.control_block_);
+    }
+
+    template <typename Y>
+    bool OwnerEqual(const SharedPtr<Y>& other) const {
+        return OwnerKey() == other.OwnerKey();
+    }
+
+    template <typename Y>
+    bool OwnerEqual(const WeakPtr<Y>& other) const {
+        return OwnerKey() == other.control_block_;
+    }
+
+    size_t OwnerHash() const {
+        return std::hash<const void*>()(OwnerKey());
+    }
+
 private:
     size_t WeakCount() const {
         if (!operator bool()) {
@@ -175,21 +323,96 @@ private:
         return control_block_->GetWeakCount();
     }
 
+    // The control block, allocated right now if the pointer is lazy. Several threads may copy one
+    // `SharedPtr` at once, so the new block is published with a CAS.
+    ControlBlock* Block() const {
+        if constexpr (kLazyBlocks && !std::is_void_v<T>) {
+            auto block = LoadBlock();
+            if (block || !stored_ptr_) {
+                return block;
+            }
+            block = new PointerControlBlock<T>(stored_ptr_);
+#ifdef SMART_POINTERS_THREADED
+            ControlBlock* expected = nullptr;
+            if (!std::atomic_ref<ControlBlock*>(control_block_).compare_exchange_strong(expected,
+                                                                                        block)) {
+                // Somebody was faster, ours does not own anything yet
+                delete block;
+                return expected;
+            }
+#else
+            control_block_ = block;
+#endif
+            return block;
+        }
+        return control_block_;
+    }
+
+    // What owner-based comparison goes by
+    const void* OwnerKey() const {
+        return Block();
+    }
+
+    ControlBlock* LoadBlock() const {
+#ifdef SMART_POINTERS_THREADED
+        if constexpr (kLazyBlocks) {
+            return std::atomic_ref<ControlBlock*>(control_block_).load();
+        }
+#endif
+        return control_block_;
+    }
+
     T* stored_ptr_;
-    ControlBlock* control_block_;
+    // Changes from null only in `Block`, on a lazy pointer
+    mutable ControlBlock* control_block_;
     template <typename Z>
     void InitWeakThis(EnableSharedFromThis<Z>* e) {
         e->weak_this_ = WeakPtr<Z>(*this);
     }
 
+    template <typename Z>
+    void InitWeakThis(EnableCompactSharedFromThis<Z>* e) {
+        e->Attach(control_block_);
+    }
+
     template <typename Y>
     friend class SharedPtr;
 
     template <typename TT, typename... Args>
     friend SharedPtr<TT> MakeShared(Args&&... args);
 
+    template <typename Y>
+    friend class SharedPool;
+
+    template <typename TT, typename... Args>
+    friend SharedPtr<TT> MakeCollectable(Args&&... args);
+
+    template <typename TT, typename... Args>
+    friend SharedPtr<TT> MakeShardedShared(Args&&... args);
+
+    template <typename TT, typename... Args>
+    friend UniquePtr<TT, ShareableDeleter> MakeUniqueShareable(Args&&... args);
+
+    friend class CycleVisitor;
+
+    friend class GraphWriter;
+
+    friend class GraphReader;
+
     template <typename Y>
     friend class WeakPtr;
+
+    template <typename Y>
+    friend class EnableCompactSharedFromThis;
+
+    template <typename K, typename V>
+    friend class WeakKeyMap;
+
+    template <typename Y, bool Shared>
+    friend class Borrowed;
+
+    template <typename Y, size_t Extent>
+    friend void ReleaseAll(std::span<SharedPtr<Y>, Extent> ptrs);
 };
 
 template <typename T, typename U>
@@ -197,6 +420,154 @@ inline bool operator==(const SharedPtr<T>& left, const SharedPtr<U>& right) {
     return (left.Get() == right.Get());
 }
 
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Casts
+// The `&&` overloads take the reference over from `other`, leaving it empty, and do not touch the
+// counters. A failed `DynamicPointerCast` leaves `other` as it was.
+
+// E.g. from `SharedPtr<void>` back to the concrete type
+template <typename T, typename U>
+SharedPtr<T> StaticPointerCast(const SharedPtr<U>& other) {
+    return SharedPtr<T>(other, static_cast<T*>(other.Get()));
+}
+
+template <typename T, typename U>
+SharedPtr<T> StaticPointerCast(SharedPtr<U>&& other) {
+    auto ptr = static_cast<T*>(other.Get());
+    return SharedPtr<T>(std::move(other), ptr);
+}
+
+template <typename T, typename U>
+SharedPtr<T> DynamicPointerCast(const SharedPtr<U>& other) {
+    if (auto ptr = dynamic_cast<T*>(other.Get())) {
+        return SharedPtr<T>(other, ptr);
+    }
+    return SharedPtr<T>();
+}
+
+template <typename T, typename U>
+SharedPtr<T> DynamicPointerCast(SharedPtr<U>&& other) {
+    if (auto ptr = dynamic_cast<T*>(other.Get())) {
+        return SharedPtr<T>(std::move(other), ptr);
+    }
+    return SharedPtr<T>();
+}
+
+template <typename T, typename U>
+SharedPtr<T> ConstPointerCast(const SharedPtr<U>& other) {
+    return SharedPtr<T>(other, const_cast<T*>(other.Get()));
+}
+
+template <typename T, typename U>
+SharedPtr<T> ConstPointerCast(SharedPtr<U>&& other) {
+    auto ptr = const_cast<T*>(other.Get());
+    return SharedPtr<T>(std::move(other), ptr);
+}
+
+template <typename T, typename U>
+SharedPtr<T> ReinterpretPointerCast(const SharedPtr<U>& other) {
+    return SharedPtr<T>(other, reinterpret_cast<T*>(other.Get()));
+}
+
+template <typename T, typename U>
+SharedPtr<T> ReinterpretPointerCast(SharedPtr<U>&& other) {
+    auto ptr = reinterpret_cast<T*>(other.Get());
+    return SharedPtr<T>(std::move(other), ptr);
+}
+
+// `StaticPointerCast`, or an empty pointer if the object is not a `T`
+template <typename T, typename U>
+SharedPtr<T> CheckedPointerCast(const SharedPtr<U>& other) {
+    if (!other.template Holds<T>()) {
+        return SharedPtr<T>();
+    }
+    return StaticPointerCast<T>(other);
+}
+
+template <typename T, typename U>
+SharedPtr<T> CheckedPointerCast(SharedPtr<U>&& other) {
+    if (!other.template Holds<T>()) {
+        return SharedPtr<T>();
+    }
+    return StaticPointerCast<T>(std::move(other));
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Bulk release
+
+#if defined(__GNUC__) || defined(__clang__)
+#define SMART_POINTERS_PREFETCH(ptr) __builtin_prefetch(ptr, 1)
+#else
+#define SMART_POINTERS_PREFETCH(ptr) static_cast<void>(ptr)
+#endif
+
+// Same as resetting every pointer, but faster for big collections, where every destructor would
+// wait for its own control block to come from memory. Blocks are prefetched a few pointers ahead,
+// neighbouring copies of one object are released with a single decrement, and the dead objects
+// are destroyed and freed in batches, one after another, instead of in between the decrements.
+template <typename T, size_t Extent>
+void ReleaseAll(std::span<SharedPtr<T>, Extent> ptrs) {
+    constexpr size_t kPrefetchDistance = 8;
+    constexpr size_t kBatch = 64;
+
+    ControlBlock* dead[kBatch];
+    size_t dead_count = 0;
+    auto bury = [&] {
+        for (size_t i = 0; i < dead_count; ++i) {
+            dead[i]->Expire();
+            dead[i]->ObjectDelete();
+        }
+        for (size_t i = 0; i < dead_count; ++i) {
+            if (dead[i]->WeakDecrement() == 0) {
+                dead[i]->BlockDelete();
+            }
+        }
+        dead_count = 0;
+    };
+
+    size_t size = ptrs.size();
+    for (size_t i = 0; i < std::min(kPrefetchDistance, size); ++i) {
+        SMART_POINTERS_PREFETCH(ptrs[i].control_block_);
+    }
+    for (size_t i = 0; i < size;) {
+        auto block = ptrs[i].control_block_;
+        if (!block) {
+            // Empty or lazy, nothing to share a decrement with
+            SharedPtr<T>(std::move(ptrs[i]));
+            ++i;
+            continue;
+        }
+        int owners = 0;
+        // Only non-empty pointers own anything, see the destructor
+        do {
+            if (i + kPrefetchDistance < size) {
+                SMART_POINTERS_PREFETCH(ptrs[i + kPrefetchDistance].control_block_);
+            }
+            if (ptrs[i]) {
+                ++owners;
+            }
+            ptrs[i].stored_ptr_ = nullptr;
+            ptrs[i].control_block_ = nullptr;
+            ++i;
+        } while (i < size && ptrs[i].control_block_ == block);
+
+        if (owners > 0 && block->DecrementBy(owners) == 0) {
+            dead[dead_count++] = block;
+            if (dead_count == kBatch) {
+                bury();
+            }
+        }
+    }
+    bury();
+}
+
+// Releases and clears the whole vector
+template <typename T>
+void ReleaseAll(std::vector<SharedPtr<T>>& ptrs) {
+    ReleaseAll(std::span<SharedPtr<T>>(ptrs));
+    ptrs.clear();
+}
+
 // Allocate memory only once
 template <typename T, typename... Args>
 SharedPtr<T> MakeShared(Args&&... args) {
@@ -207,11 +578,66 @@ SharedPtr<T> MakeShared(Args&&... args) {
     if constexpr (std::is_convertible_v<T*, ESFTBase*>) {
         res.InitWeakThis(res.stored_ptr_);
     }
+    SMART_POINTERS_PROBE(make_shared, T, res.stored_ptr_);
     return res;
 }
 
+// Deleter of `MakeUniqueShareable` objects, knows their control block
+class ShareableDeleter {
+public:
+    ShareableDeleter() = default;
+
+    // The block belongs to one pointer, a moved-from deleter must not keep it
+    ShareableDeleter(ShareableDeleter&& other) noexcept
+        : block_(std::exchange(other.block_, nullptr)){};
+
+    ShareableDeleter& operator=(ShareableDeleter&& other) noexcept {
+        block_ = std::exchange(other.block_, nullptr);
+        return *this;
+    }
+
+    // Without a block the object came from plain `new`, as with `DefaultDeleter`. The block is
+    // forgotten afterwards, `Reset(new T)` on the same `UniquePtr` takes that path.
+    template <typename T>
+    void operator()(T* ptr) {
+        auto block = std::exchange(block_, nullptr);
+        if (!block) {
+            delete ptr;
+            return;
+        }
+        block->Expire();
+        block->ObjectDelete();
+        if (block->WeakDecrement() == 0) {
+            block->BlockDelete();
+        }
+    }
+
+private:
+    explicit ShareableDeleter(ControlBlock* block) : block_(block){};
+
+    ControlBlock* block_ = nullptr;
+
+    template <typename Y>
+    friend class SharedPtr;
+
+    template <typename TT, typename... Args>
+    friend UniquePtr<TT, ShareableDeleter> MakeUniqueShareable(Args&&... args);
+};
+
+// `MakeUnique` for objects which might get shared later: the object is created next to a control
+// block, same as with `MakeShared`, so `SharedPtr(std::move(unique))` allocates nothing. Until then
+// the strong count is zero, so `SharedFromThis` throws.
+template <typename T, typename... Args>
+UniquePtr<T, ShareableDeleter> MakeUniqueShareable(Args&&... args) {
+    auto block = new ObjectControlBlock<T>(std::forward<Args>(args)...);
+    block->operator--();
+    return UniquePtr<T, ShareableDeleter>(block->Get(), ShareableDeleter(block));
+}
+
 class ESFTBase {};
 
+class CompactESFTBase : public ESFTBase {};
+
 template <typename T>
 class EnableSharedFromThis : public ESFTBase {
 public:
@@ -234,3 +660,63 @@ private:
     template <typename Y>
     friend class SharedPtr;
 };
+
+// `EnableSharedFromThis` which takes no space in the object and costs no weak reference.
+//
+// `MakeShared` puts the object right after its control block, so the block is found at a fixed
+// distance from the object. Owners made anywhere else would have their block somewhere else, so
+// `SharedPtr(T*)`, `SharedPtr(UniquePtr)`, `MakeCollectable` and `MakeShardedShared` do not
+// compile for such types. `MakeUniqueShareable` works; a `UniquePtr<T, ShareableDeleter>` to a
+// plain `new T` cannot be caught at compile time, debug builds assert on it. Unlike
+// `EnableSharedFromThis`, calling `SharedFromThis` or `WeakFromThis` on an object no `SharedPtr`
+// has ever owned is undefined behaviour.
+template <typename T>
+class EnableCompactSharedFromThis : public CompactESFTBase {
+public:
+    SharedPtr<T> SharedFromThis() {
+        return MakeOwner<T>();
+    }
+    SharedPtr<const T> SharedFromThis() const {
+        return MakeOwner<const T>();
+    }
+    WeakPtr<T> WeakFromThis() noexcept {
+        return MakeObserver<T>();
+    }
+    WeakPtr<const T> WeakFromThis() const noexcept {
+        return MakeObserver<const T>();
+    }
+
+private:
+    void Attach([[maybe_unused]] ControlBlock* block) {
+        assert(block == Block() && "not created by MakeShared or MakeUniqueShareable");
+    }
+
+    ControlBlock* Block() const {
+        return ObjectControlBlock<T>::FromObject(static_cast<const T*>(this));
+    }
+
+    template <typename Y>
+    SharedPtr<Y> MakeOwner() const {
+        auto block = Block();
+        if (!block->TryIncrement()) {
+            throw BadWeakPtr();
+        }
+        SharedPtr<Y> res;
+        res.stored_ptr_ = static_cast<Y*>(const_cast<EnableCompactSharedFromThis*>(this));
+        res.control_block_ = block;
+        return res;
+    }
+
+    template <typename Y>
+    WeakPtr<Y> MakeObserver() const {
+        auto block = Block();
+        block->WeakIncrement();
+        WeakPtr<Y> res;
+        res.stored_ptr_ = static_cast<Y*>(const_cast<EnableCompactSharedFromThis*>(this));
+        res.control_block_ = block;
+        return res;
+    }
+
+    template <typename Y>
+    friend class SharedPtr;
+};
@@ -0,0 +1,425 @@
+#pragma once
+
+#include "shared.h"
+
+#include <atomic>
+#include <cstddef>
+#include <functional>
+#include <limits>
+#include <new>
+#include <type_traits>
+
+// Recycling pool of `T`s handed out as `SharedPtr<T>`.
+//
+// Every object lives inside a `PooledControlBlock`. When the strong count drops to zero the block
+// runs the reset hook instead of destroying the object, and when the block itself is released it is
+// returned to the pool instead of being deleted. The next `Acquire` picks it up again, so steady
+// state churn costs neither `new` nor `delete`.
+//
+// Free blocks are kept in two places:
+//  * a global lock-free stack (Treiber stack). Pushes are a single CAS, pops always take the whole
+//    stack with one `exchange`, so there is no ABA problem and no need for hazard pointers;
+//  * a per-thread cache. Whatever a thread took from the global stack stays in its cache, and
+//    releases on that thread go to the cache first, so the common path touches no shared state.
+//    There is one such cache per thread and `T`, shared by all pools of `T`: it holds the blocks
+//    of the pool the thread used last, so a thread alternating between two live pools of the same
+//    type keeps flushing the cache back and forth.
+
+template <typename T>
+class SharedPool;
+
+template <typename T>
+class SharedPoolCore;
+
+struct SharedPoolStats {
+    size_t acquired = 0;   // `Acquire` calls
+    size_t reused = 0;     // ... served by a recycled block
+    size_t recycled = 0;   // blocks given back to the pool
+    size_t discarded = 0;  // blocks freed because the pool was full or already destroyed
+
+    double ReuseRate() const {
+        return acquired == 0 ? 0.0 : static_cast<double>(reused) / static_cast<double>(acquired);
+    }
+};
+
+template <typename T>
+class PooledControlBlock : public ControlBlock,
+                           public BackendAllocated<PooledControlBlock<T>, T> {
+public:
+    explicit PooledControlBlock(SharedPoolCore<T>* core)
+        : counter_(1), weak_counter_(1), core_(core), next_(nullptr) {
+        new (&buf_) T();
+    }
+
+    void operator++() override {
+        ++counter_;
+    }
+
+    int operator--() override {
+        return --counter_;
+    }
+
+    int WeakDecrement() override {
+        return --weak_counter_;
+    }
+
+    void WeakIncrement() override {
+        ++weak_counter_;
+    }
+
+    void IncrementBy(int n) override {
+        counter_ += n;
+    }
+
+    void WeakIncrementBy(int n) override {
+        weak_counter_ += n;
+    }
+
+    bool TryIncrement() override {
+        return IncrementIfNonZero(counter_);
+    }
+
+    T* Get() {
+        return reinterpret_cast<T*>(&buf_);
+    }
+
+    int GetCount() const override {
+        return counter_;
+    }
+
+    int GetWeakCount() const override {
+        return weak_counter_;
+    }
+
+    ~PooledControlBlock() override {
+        Get()->~T();
+    }
+
+    // Back from the pool, with a single owner again.
+    void Revive() {
+        counter_ = 1;
+        weak_counter_ = 1;
+        ResetExpiry();
+    }
+
+    // The object stays alive, it only gets reset for the next owner.
+    void ObjectDelete() override {
+        SMART_POINTERS_PROBE(object_delete, T, Get());
+        core_->ResetObject(*Get());
+    }
+
+    TypeTag ObjectType() const override {
+        return kTypeTagOf<T>;
+    }
+
+    void BlockDelete() override {
+        core_->Recycle(this);
+    }
+
+private:
+    RefCounter counter_;
+    RefCounter weak_counter_;
+    SharedPoolCore<T>* core_;
+    PooledControlBlock* next_;
+    alignas(T) char buf_[sizeof(T)];
+
+    friend class SharedPoolCore<T>;
+};
+
+// Shared state of a pool. Outlives the `SharedPool` handle as long as any of its blocks exist,
+// so objects may be released after the pool is gone.
+template <typename T>
+class SharedPoolCore {
+public:
+    using Block = PooledControlBlock<T>;
+
+    static constexpr size_t kThreadCacheSize = 64;
+
+    SharedPoolCore(size_t capacity, std::function<void(T&)> reset)
+        : capacity_(capacity), reset_(std::move(reset)) {
+    }
+
+    void Ref() {
+        refs_.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    void Unref() {
+        if (refs_.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+            delete this;
+        }
+    }
+
+    void ResetObject(T& object) {
+        if (reset_) {
+            reset_(object);
+        }
+    }
+
+    Block* Pop() {
+        ThreadCache& cache = LocalCache();
+        cache.DropIfClosed();
+        if (cache.core_ == this && cache.head_) {
+            return cache.Pop();
+        }
+        Block* list = free_head_.exchange(nullptr);
+        if (!list) {
+            return nullptr;
+        }
+        idle_.fetch_sub(1, std::memory_order_relaxed);
+        Block* res = list;
+        cache.Bind(this);
+        Block* block = list->next_;
+        while (block && cache.size_ < kThreadCacheSize) {
+            Block* next = block->next_;
+            cache.Push(block);
+            block = next;
+        }
+        // Leave the rest to the other threads instead of hoarding it
+        if (block) {
+            Block* last = block;
+            while (last->next_) {
+                last = last->next_;
+            }
+            PushChain(block, last);
+        }
+        return res;
+    }
+
+    void Recycle(Block* block) {
+        if (closed_.load()) {
+            discarded_.fetch_add(1, std::memory_order_relaxed);
+            Destroy(block);
+            return;
+        }
+        if (idle_.fetch_add(1, std::memory_order_relaxed) >= capacity_) {
+            idle_.fetch_sub(1, std::memory_order_relaxed);
+            discarded_.fetch_add(1, std::memory_order_relaxed);
+            Destroy(block);
+            return;
+        }
+        recycled_.fetch_add(1, std::memory_order_relaxed);
+
+        ThreadCache& cache = LocalCache();
+        cache.DropIfClosed();
+        if (cache.core_ == this && cache.size_ < kThreadCacheSize && !closed_.load()) {
+            cache.Push(block);
+            // `Close` only flushes its own thread's cache, so a close that has slipped in between
+            // is on us
+            cache.DropIfClosed();
+            return;
+        }
+        PushChain(block, block);
+        // The pool might have been closed in between, in which case nobody else is going to drain
+        // what we have just pushed.
+        if (closed_.load()) {
+            Drain();
+        }
+    }
+
+    void Close() {
+        closed_.store(true);
+        ThreadCache& cache = LocalCache();
+        if (cache.core_ == this) {
+            cache.Flush();
+        }
+        Drain();
+        Unref();
+    }
+
+    SharedPoolStats Stats() const {
+        SharedPoolStats res;
+        res.acquired = acquired_.load(std::memory_order_relaxed);
+        res.reused = reused_.load(std::memory_order_relaxed);
+        res.recycled = recycled_.load(std::memory_order_relaxed);
+        res.discarded = discarded_.load(std::memory_order_relaxed);
+        return res;
+    }
+
+    size_t Idle() const {
+        return idle_.load(std::memory_order_relaxed);
+    }
+
+private:
+    // Blocks of at most one core at a time, the one this thread touched last. Shared by all pools
+    // of `T`, see the top of the file.
+    class ThreadCache {
+    public:
+        ~ThreadCache() {
+            Flush();
+        }
+
+        void Bind(SharedPoolCore* core) {
+            if (core_ == core) {
+                return;
+            }
+            Flush();
+            core_ = core;
+            core_->Ref();
+        }
+
+        // A binding to a closed pool only keeps its idle blocks and the core alive
+        void DropIfClosed() {
+            if (core_ && core_->closed_.load()) {
+                Flush();
+            }
+        }
+
+        void Push(Block* block) {
+            block->next_ = head_;
+            head_ = block;
+            if (!tail_) {
+                tail_ = block;
+            }
+            ++size_;
+        }
+
+        Block* Pop() {
+            Block* res = head_;
+            head_ = res->next_;
+            if (!head_) {
+                tail_ = nullptr;
+            }
+            --size_;
+            core_->idle_.fetch_sub(1, std::memory_order_relaxed);
+            return res;
+        }
+
+        // Give everything back to the global stack and let go of the core.
+        void Flush() {
+            if (!core_) {
+                return;
+            }
+            auto core = core_;
+            auto head = head_;
+            auto tail = tail_;
+            core_ = nullptr;
+            head_ = tail_ = nullptr;
+            size_ = 0;
+            if (head) {
+                core->PushChain(head, tail);
+                if (core->closed_.load()) {
+                    core->Drain();
+                }
+            }
+            core->Unref();
+        }
+
+    private:
+        SharedPoolCore* core_ = nullptr;
+        Block* head_ = nullptr;
+        Block* tail_ = nullptr;
+        size_t size_ = 0;
+
+        friend class SharedPoolCore;
+    };
+
+    static ThreadCache& LocalCache() {
+        static thread_local ThreadCache cache;
+        return cache;
+    }
+
+    ~SharedPoolCore() = default;
+
+    void PushChain(Block* first, Block* last) {
+        Block* head = free_head_.load();
+        do {
+            last->next_ = head;
+        } while (!free_head_.compare_exchange_weak(head, first));
+    }
+
+    void Drain() {
+        for (Block* block = free_head_.exchange(nullptr); block;) {
+            Block* next = block->next_;
+            idle_.fetch_sub(1, std::memory_order_relaxed);
+            Destroy(block);
+            block = next;
+        }
+    }
+
+    void Destroy(Block* block) {
+        delete block;
+        Unref();
+    }
+
+    const size_t capacity_;
+    const std::function<void(T&)> reset_;
+
+    std::atomic<Block*> free_head_{nullptr};
+    std::atomic<size_t> idle_{0};
+    std::atomic<bool> closed_{false};
+    // The `SharedPool` handle, every block in existence and every thread cache bound to us.
+    std::atomic<size_t> refs_{1};
+
+    std::atomic<size_t> acquired_{0};
+    std::atomic<size_t> reused_{0};
+    std::atomic<size_t> recycled_{0};
+    std::atomic<size_t> discarded_{0};
+
+    friend class SharedPool<T>;
+};
+
+template <typename T>
+class SharedPool {
+public:
+    static_assert(!std::is_convertible_v<T*, ESFTBase*>,
+                  "pooled objects outlive their owners, SharedFromThis would keep them pinned");
+
+    static constexpr size_t kUnbounded = std::numeric_limits<size_t>::max();
+
+    ////////////////////////////////////////////////////////////////////////////////////////////////
+    // Constructors
+
+    // `capacity` limits how many idle objects are kept around, the rest are freed on release.
+    // `reset` is run on an object every time its last owner lets it go.
+    explicit SharedPool(size_t capacity = kUnbounded, std::function<void(T&)> reset = nullptr)
+        : core_(new SharedPoolCore<T>(capacity, std::move(reset))){};
+
+    SharedPool(const SharedPool&) = delete;
+    SharedPool& operator=(const SharedPool&) = delete;
+
+    ////////////////////////////////////////////////////////////////////////////////////////////////
+    // Destructor
+
+    // Idle objects are freed right away, except those cached by other threads: these go when their
+    // thread exits or next touches a pool of `T`. Objects still in use are freed on their last
+    // release.
+    ~SharedPool() {
+        core_->Close();
+    }
+
+    ////////////////////////////////////////////////////////////////////////////////////////////////
+    // Modifiers
+
+    // Recycled object if there is one, otherwise a freshly default-constructed `T`.
+    SharedPtr<T> Acquire() {
+        core_->acquired_.fetch_add(1, std::memory_order_relaxed);
+        auto block = core_->Pop();
+        if (block) {
+            core_->reused_.fetch_add(1, std::memory_order_relaxed);
+            block->Revive();
+        } else {
+            block = new PooledControlBlock<T>(core_);
+            core_->Ref();
+        }
+
+        SharedPtr<T> res;
+        res.control_block_ = block;
+        res.stored_ptr_ = block->Get();
+        return res;
+    }
+
+    ////////////////////////////////////////////////////////////////////////////////////////////////
+    // Observers
+
+    SharedPoolStats Stats() const {
+        return core_->Stats();
+    }
+
+    // Objects waiting for reuse, in all thread caches included.
+    size_t Idle() const {
+        return core_->Idle();
+    }
+
+private:
+    SharedPoolCore<T>* core_;
+};
@@ -0,0 +1,297 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <span>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+// Generational slot map: objects in one contiguous array, referred to by 8-byte `Handle`s.
+//
+// For when all a `WeakPtr` is used for is to find out whether an object is still there. A handle
+// is a slot index and a generation, `Get` and `Expired` are two array lookups, and there is no
+// control block, no reference counting and no allocation per object.
+//
+// Slots are never freed, only reused. Their generation is odd while the slot holds an object and
+// is bumped on every insert and erase, so a handle of an erased object never matches again (until
+// the 32-bit generation of that very slot wraps around). The objects themselves are kept dense: the
+// last one moves into the hole on erase. That keeps iteration a plain loop over `Values()`, but
+// means that the order changes and that erasing invalidates references to the last object.
+//
+// `SlotOwner` is the `UniquePtr` of a slot map: it erases its object when it goes away.
+
+template <typename T>
+class SlotMap;
+
+template <typename T>
+class Handle {
+public:
+    constexpr Handle() = default;
+
+    constexpr uint32_t Index() const {
+        return index_;
+    }
+
+    constexpr uint32_t Generation() const {
+        return generation_;
+    }
+
+    // Whether it has ever referred to an object, not whether the object is still there
+    constexpr explicit operator bool() const {
+        return generation_ != 0;
+    }
+
+    friend constexpr bool operator==(Handle, Handle) = default;
+
+private:
+    constexpr Handle(uint32_t index, uint32_t generation)
+        : index_(index), generation_(generation){};
+
+    uint32_t index_ = 0;
+    uint32_t generation_ = 0;
+
+    friend class SlotMap<T>;
+};
+
+template <typename T>
+class SlotOwner;
+
+template <typename T>
+class SlotMap {
+public:
+    ////////////////////////////////////////////////////////////////////////////////////////////////
+    // Constructors
+
+    SlotMap() = default;
+
+    // `SlotOwner`s point to their map
+    SlotMap(const SlotMap&) = delete;
+    SlotMap& operator=(const SlotMap&) = delete;
+
+    ////////////////////////////////////////////////////////////////////////////////////////////////
+    // Modifiers
+
+    template <typename... Args>
+    Handle<T> Emplace(Args&&... args) {
+        if (free_head_ == kNone) {
+            if (slots_.size() == kNone) {
+                throw std::length_error("SlotMap is full");
+            }
+            slots_.push_back({kNone, 0});
+            free_head_ = static_cast<uint32_t>(slots_.size() - 1);
+        }
+        uint32_t slot = free_head_;
+        // A throwing `push_back` or constructor leaves everything as it was
+        owners_.push_back(slot);
+        try {
+            values_.emplace_back(std::forward<Args>(args)...);
+        } catch (...) {
+            owners_.pop_back();
+            throw;
+        }
+
+        auto& entry = slots_[slot];
+        free_head_ = entry.index;
+        entry.index = static_cast<uint32_t>(values_.size() - 1);
+        ++entry.generation;
+        return Handle<T>(slot, entry.generation);
+    }
+
+    template <typename... Args>
+    SlotOwner<T> EmplaceOwned(Args&&... args) {
+        return SlotOwner<T>(*this, Emplace(std::forward<Args>(args)...));
+    }
+
+    // Returns whether the object was still there
+    bool Erase(Handle<T> handle) {
+        if (Expired(handle)) {
+            return false;
+        }
+        auto& entry = slots_[handle.index_];
+        uint32_t hole = entry.index;
+        uint32_t last = static_cast<uint32_t>(values_.size() - 1);
+        if (hole != last) {
+            values_[hole] = std::move(values_[last]);
+            owners_[hole] = owners_[last];
+            slots_[owners_[hole]].index = hole;
+        }
+        values_.pop_back();
+        owners_.pop_back();
+
+        ++entry.generation;
+        entry.index = free_head_;
+        free_head_ = handle.index_;
+        return true;
+    }
+
+    // Expires all the handles
+    void Clear() {
+        for (auto slot : owners_) {
+            ++slots_[slot].generation;
+            slots_[slot].index = free_head_;
+            free_head_ = slot;
+        }
+        values_.clear();
+        owners_.clear();
+    }
+
+    void Reserve(size_t capacity) {
+        slots_.reserve(capacity);
+        values_.reserve(capacity);
+        owners_.reserve(capacity);
+    }
+
+    ////////////////////////////////////////////////////////////////////////////////////////////////
+    // Lookups
+
+    bool Expired(Handle<T> handle) const {
+        // Odd generations are live ones, this also rejects `Handle()`
+        return handle.index_ >= slots_.size() ||
+               slots_[handle.index_].generation != handle.generation_ ||
+               handle.generation_ % 2 == 0;
+    }
+
+    // The object, or `nullptr` if it has been erased
+    T* Get(Handle<T> handle) {
+        return Expired(handle) ? nullptr : &values_[slots_[handle.index_].index];
+    }
+
+    const T* Get(Handle<T> handle) const {
+        return Expired(handle) ? nullptr : &values_[slots_[handle.index_].index];
+    }
+
+    ////////////////////////////////////////////////////////////////////////////////////////////////
+    // Dense access
+    // All the objects, in no particular order. Position `i` belongs to `HandleAt(i)`.
+
+    std::span<T> Values() {
+        return values_;
+    }
+
+    std::span<const T> Values() const {
+        return values_;
+    }
+
+    Handle<T> HandleAt(size_t position) const {
+        uint32_t slot = owners_[position];
+        return Handle<T>(slot, slots_[slot].generation);
+    }
+
+    T* begin() {
+        return values_.data();
+    }
+
+    T* end() {
+        return values_.data() + values_.size();
+    }
+
+    const T* begin() const {
+        return values_.data();
+    }
+
+    const T* end() const {
+        return values_.data() + values_.size();
+    }
+
+    ////////////////////////////////////////////////////////////////////////////////////////////////
+    // Observers
+
+    size_t Size() const {
+        return values_.size();
+    }
+
+    bool Empty() const {
+        return values_.empty();
+    }
+
+private:
+    static constexpr uint32_t kNone = std::numeric_limits<uint32_t>::max();
+
+    struct Slot {
+        uint32_t index;  // into `values_` while live, next free slot otherwise
+        uint32_t generation;
+    };
+
+    std::vector<Slot> slots_;
+    std::vector<T> values_;
+    std::vector<uint32_t> owners_;  // slot of every value
+    uint32_t free_head_ = kNone;
+};
+
+template <typename T>
+class SlotOwner {
+public:
+    ////////////////////////////////////////////////////////////////////////////////////////////////
+    // Constructors
+
+    SlotOwner() = default;
+
+    // Takes over `handle`, its object is erased together with the owner
+    SlotOwner(SlotMap<T>& map, Handle<T> handle) : map_(&map), handle_(handle){};
+
+    SlotOwner(SlotOwner&& other) noexcept
+        : map_(std::exchange(other.map_, nullptr)), handle_(std::exchange(other.handle_, {})){};
+
+    SlotOwner& operator=(SlotOwner&& other) noexcept {
+        if (this != &other) {
+            Reset();
+            map_ = std::exchange(other.map_, nullptr);
+            handle_ = std::exchange(other.handle_, {});
+        }
+        return *this;
+    }
+
+    ////////////////////////////////////////////////////////////////////////////////////////////////
+    // Destructor
+
+    ~SlotOwner() {
+        Reset();
+    }
+
+    ////////////////////////////////////////////////////////////////////////////////////////////////
+    // Modifiers
+
+    // The object stays in the map
+    Handle<T> Release() {
+        map_ = nullptr;
+        return std::exchange(handle_, {});
+    }
+
+    void Reset() {
+        if (map_) {
+            map_->Erase(handle_);
+        }
+        map_ = nullptr;
+        handle_ = {};
+    }
+
+    ////////////////////////////////////////////////////////////////////////////////////////////////
+    // Observers
+
+    Handle<T> GetHandle() const {
+        return handle_;
+    }
+
+    // `nullptr` for an empty owner, or if someone has erased the object behind its back
+    T* Get() const {
+        return map_ ? map_->Get(handle_) : nullptr;
+    }
+
+    T& operator*() const {
+        return *Get();
+    }
+
+    T* operator->() const {
+        return Get();
+    }
+
+    explicit operator bool() const {
+        return Get() != nullptr;
+    }
+
+private:
+    SlotMap<T>* map_ = nullptr;
+    Handle<T> handle_;
+};
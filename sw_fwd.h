@@ -1,11 +1,76 @@
 #pragma once
 
+#include "allocation.h"
+#include "compressed_pair.h"
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
 #include <exception>
+#include <limits>
+#include <stdexcept>
+#include <type_traits>
 
 // Forward declarations and control blocks
 
+// Define `SMART_POINTERS_THREADED` to make reference counting safe when owners of one object live
+// in different threads. Without it counters are plain `int`s.
+#ifdef SMART_POINTERS_THREADED
+using RefCounter = std::atomic<int>;
+#else
+using RefCounter = int;
+#endif
+
+// Define `SMART_POINTERS_LAZY_BLOCKS` to make `SharedPtr(T*)` allocate its control block only
+// when the pointer is first copied or observed by a `WeakPtr`. The price is that `T` has to be
+// complete wherever a `SharedPtr<T>` is copied or destroyed, same as with `UniquePtr`.
+#ifdef SMART_POINTERS_LAZY_BLOCKS
+inline constexpr bool kLazyBlocks = true;
+#else
+inline constexpr bool kLazyBlocks = false;
+#endif
+
+// `++counter` unless it has already dropped to zero. Returns whether it succeeded.
+inline bool IncrementIfNonZero(RefCounter& counter) {
+#ifdef SMART_POINTERS_THREADED
+    int value = counter.load();
+    while (value != 0) {
+        if (counter.compare_exchange_weak(value, value + 1)) {
+            return true;
+        }
+    }
+    return false;
+#else
+    if (counter == 0) {
+        return false;
+    }
+    ++counter;
+    return true;
+#endif
+}
+
+// `n` new references at once, as an amount for the counters. Throws `std::length_error` if it
+// does not fit, instead of wrapping around.
+inline int BulkCount(size_t n) {
+    if (n > static_cast<size_t>(std::numeric_limits<int>::max())) {
+        throw std::length_error("too many references at once");
+    }
+    return static_cast<int>(n);
+}
+
 class BadWeakPtr : public std::exception {};
 
+// Identifies a type without RTTI: `kTypeTagOf<T>` is unique for every `T`. The tags are not
+// `const`: identical read-only constants may be folded into one by the compiler or the linker
+// (`-fmerge-all-constants`, identical code folding), and then two types would share a tag.
+using TypeTag = const void*;
+
+template <typename T>
+inline char kTypeTag = 0;
+
+template <typename T>
+inline constexpr TypeTag kTypeTagOf = &kTypeTag<std::remove_cv_t<T>>;
+
 template <typename T>
 class SharedPtr;
 
@@ -14,43 +79,196 @@ class WeakPtr;
 
 class ESFTBase;
 
+class CompactESFTBase;
+
+// Objects with `EnableCompactSharedFromThis` find their control block next to themselves, so
+// only `MakeShared` and `MakeUniqueShareable` may create their owners
+template <typename T>
+inline constexpr bool kCompactSharedFromThis = std::is_convertible_v<T*, CompactESFTBase*>;
+
 template <typename T>
 class EnableSharedFromThis;
 
+template <typename T>
+class EnableCompactSharedFromThis;
+
+class ShareableDeleter;
+
+template <typename K, typename V>
+class WeakKeyMap;
+
+// A callback waiting for an object to expire, see `WeakPtr::OnExpire`. `invoke` runs it (or only
+// frees it, if `run` is false) and is responsible for deleting the node.
+struct ExpiryNode {
+    ExpiryNode* next = nullptr;
+    void (*invoke)(ExpiryNode* self, bool run) = nullptr;
+};
+
+#ifdef SMART_POINTERS_THREADED
+using ExpiryList = std::atomic<ExpiryNode*>;
+#else
+using ExpiryList = ExpiryNode*;
+#endif
+
+// All the strong owners together hold one weak reference, dropped right after `ObjectDelete`.
+// That way exactly one party sees the weak count hit zero and calls `BlockDelete`, no matter in
+// which order the last `SharedPtr` and the last `WeakPtr` go away.
 class ControlBlock {
 public:
     virtual int GetCount() const = 0;
     virtual int GetWeakCount() const = 0;
     virtual void operator++() = 0;
-    virtual void operator--() = 0;
-    virtual void WeakDecrement() = 0;
+    // Both decrements return the new value
+    virtual int operator--() = 0;
+    virtual int WeakDecrement() = 0;
     virtual void WeakIncrement() = 0;
-    virtual ~ControlBlock() = default;
+    // Bulk versions, `n` new owners or observers for the price of one update
+    virtual void IncrementBy(int n) = 0;
+    virtual void WeakIncrementBy(int n) = 0;
+    // `n` owners gone at once, returns the new value like `operator--`
+    virtual int DecrementBy(int n) {
+        int res = 0;
+        for (int i = 0; i < n; ++i) {
+            res = operator--();
+        }
+        return res;
+    }
+    // Used by `WeakPtr::Lock`, must not resurrect a dead object
+    virtual bool TryIncrement() = 0;
+    virtual ~ControlBlock() {
+        // Never expired, e.g. a pooled block freed with the pool
+        ExpiryNode* node = expiry_;
+        if (node != Fired()) {
+            InvokeAll(node, false);
+        }
+    }
     virtual void ObjectDelete() = 0;
+
+    // The type the block has created or adopted its object as, if it knows
+    virtual TypeTag ObjectType() const {
+        return nullptr;
+    }
+
+    // Called once both counters are gone. Pooled blocks override it to recycle themselves.
+    virtual void BlockDelete() {
+        delete this;
+    }
+
+    ////////////////////////////////////////////////////////////////////////////////////////////////
+    // Expiry callbacks
+
+    // Called by whoever has brought the strong count to zero, right before `ObjectDelete`
+    void Expire() {
+        // Nothing to run is the common case, so do not write to the block then. A callback added
+        // concurrently sees the zero count and runs the list itself.
+        ExpiryNode* head = expiry_;
+        if (head == nullptr) {
+            return;
+        }
+        InvokeAll(Exchange(Fired()), true);
+    }
+
+    // Runs `node` on expiry, or right away if the object has already expired
+    void AddExpiryNode(ExpiryNode* node) {
+        ExpiryNode* head = expiry_;
+        do {
+            if (head == Fired()) {
+                node->invoke(node, true);
+                return;
+            }
+            node->next = head;
+        } while (!CompareExchange(head, node));
+        // We might have missed `Expire`
+        if (GetCount() == 0) {
+            InvokeAll(Exchange(Fired()), true);
+        }
+    }
+
+protected:
+    // A block which is going to be used for a new object, see `SharedPool`
+    void ResetExpiry() {
+        expiry_ = nullptr;
+    }
+
+private:
+    static ExpiryNode* Fired() {
+        static ExpiryNode fired;
+        return &fired;
+    }
+
+    static void InvokeAll(ExpiryNode* node, bool run) {
+        while (node && node != Fired()) {
+            auto next = node->next;
+            node->invoke(node, run);
+            node = next;
+        }
+    }
+
+    ExpiryNode* Exchange(ExpiryNode* value) {
+#ifdef SMART_POINTERS_THREADED
+        return expiry_.exchange(value);
+#else
+        auto res = expiry_;
+        expiry_ = value;
+        return res;
+#endif
+    }
+
+    bool CompareExchange(ExpiryNode*& expected, ExpiryNode* desired) {
+#ifdef SMART_POINTERS_THREADED
+        return expiry_.compare_exchange_weak(expected, desired);
+#else
+        if (expiry_ != expected) {
+            expected = expiry_;
+            return false;
+        }
+        expiry_ = desired;
+        return true;
+#endif
+    }
+
+    ExpiryList expiry_ = nullptr;
 };
 
 template <typename T>
-class PointerControlBlock : public ControlBlock {
+class PointerControlBlock : public ControlBlock,
+                            public BackendAllocated<PointerControlBlock<T>, T> {
 public:
     PointerControlBlock() : counter_(0), weak_counter_(0), ptr_(nullptr){};
-    explicit PointerControlBlock(T* ptr) : counter_(1), weak_counter_(0), ptr_(ptr){};
+    explicit PointerControlBlock(T* ptr) : counter_(1), weak_counter_(1), ptr_(ptr){};
 
     void operator++() override {
         ++counter_;
     }
 
-    void operator--() override {
-        --counter_;
+    int operator--() override {
+        return --counter_;
     }
 
-    void WeakDecrement() override {
-        --weak_counter_;
+    int WeakDecrement() override {
+        return --weak_counter_;
     }
 
     void WeakIncrement() override {
         ++weak_counter_;
     }
 
+    void IncrementBy(int n) override {
+        counter_ += n;
+    }
+
+    void WeakIncrementBy(int n) override {
+        weak_counter_ += n;
+    }
+
+    int DecrementBy(int n) override {
+        return counter_ -= n;
+    }
+
+    bool TryIncrement() override {
+        return IncrementIfNonZero(counter_);
+    }
+
     int GetCount() const override {
         return counter_;
     }
@@ -62,42 +280,135 @@ public:
     ~PointerControlBlock() override = default;
 
     void ObjectDelete() override {
+        SMART_POINTERS_PROBE(object_delete, T, ptr_);
         delete ptr_;
     }
 
+    TypeTag ObjectType() const override {
+        return kTypeTagOf<T>;
+    }
+
 private:
-    int counter_;
-    int weak_counter_;
+    RefCounter counter_;
+    RefCounter weak_counter_;
     T* ptr_;
 };
 
+// Owner of a pointer with a custom deleter, e.g. taken over from a `UniquePtr`
+template <typename T, typename Deleter>
+class DeleterControlBlock : public ControlBlock,
+                            public BackendAllocated<DeleterControlBlock<T, Deleter>, T> {
+public:
+    DeleterControlBlock(T* ptr, Deleter deleter)
+        : counter_(1), weak_counter_(1), data_(ptr, std::move(deleter)){};
+
+    void operator++() override {
+        ++counter_;
+    }
+
+    int operator--() override {
+        return --counter_;
+    }
+
+    int WeakDecrement() override {
+        return --weak_counter_;
+    }
+
+    void WeakIncrement() override {
+        ++weak_counter_;
+    }
+
+    void IncrementBy(int n) override {
+        counter_ += n;
+    }
+
+    void WeakIncrementBy(int n) override {
+        weak_counter_ += n;
+    }
+
+    int DecrementBy(int n) override {
+        return counter_ -= n;
+    }
+
+    bool TryIncrement() override {
+        return IncrementIfNonZero(counter_);
+    }
+
+    int GetCount() const override {
+        return counter_;
+    }
+
+    int GetWeakCount() const override {
+        return weak_counter_;
+    }
+
+    ~DeleterControlBlock() override = default;
+
+    void ObjectDelete() override {
+        SMART_POINTERS_PROBE(object_delete, T, data_.GetFirst());
+        data_.GetSecond()(data_.GetFirst());
+    }
+
+    TypeTag ObjectType() const override {
+        return kTypeTagOf<T>;
+    }
+
+private:
+    RefCounter counter_;
+    RefCounter weak_counter_;
+    CompressedPair<T*, Deleter> data_;
+};
+
 template <typename T>
-class ObjectControlBlock : public ControlBlock {
+class ObjectControlBlock : public ControlBlock,
+                           public BackendAllocated<ObjectControlBlock<T>, T> {
 public:
     template <typename... Args>
-    ObjectControlBlock(Args&&... args) : counter_(1), weak_counter_(0) {
+    ObjectControlBlock(Args&&... args) : counter_(1), weak_counter_(1) {
         new (&buf_) T(std::forward<Args>(args)...);
     }
 
     void operator++() override {
         ++counter_;
     }
-    void operator--() override {
-        --counter_;
+    int operator--() override {
+        return --counter_;
     }
 
-    void WeakDecrement() override {
-        --weak_counter_;
+    int WeakDecrement() override {
+        return --weak_counter_;
     }
 
     void WeakIncrement() override {
         ++weak_counter_;
     }
 
+    void IncrementBy(int n) override {
+        counter_ += n;
+    }
+
+    void WeakIncrementBy(int n) override {
+        weak_counter_ += n;
+    }
+
+    int DecrementBy(int n) override {
+        return counter_ -= n;
+    }
+
+    bool TryIncrement() override {
+        return IncrementIfNonZero(counter_);
+    }
+
     T* Get() {
         return reinterpret_cast<T*>(&buf_);
     }
 
+    // The inverse of `Get`
+    static ObjectControlBlock* FromObject(const T* object) {
+        auto address = reinterpret_cast<std::uintptr_t>(object) - kObjectOffset;
+        return reinterpret_cast<ObjectControlBlock*>(address);
+    }
+
     int GetCount() const override {
         return counter_;
     }
@@ -108,11 +419,20 @@ public:
     ~ObjectControlBlock() override = default;
 
     void ObjectDelete() override {
+        SMART_POINTERS_PROBE(object_delete, T, Get());
         Get()->~T();
     }
 
+    TypeTag ObjectType() const override {
+        return kTypeTagOf<T>;
+    }
+
 private:
-    int counter_;
-    int weak_counter_;
+    // Where `buf_` is: after the base and both counters, rounded up to the alignment of `T`
+    static constexpr std::uintptr_t kObjectOffset =
+        (sizeof(ControlBlock) + 2 * sizeof(RefCounter) + alignof(T) - 1) / alignof(T) * alignof(T);
+
+    RefCounter counter_;
+    RefCounter weak_counter_;
     alignas(T) char buf_[sizeof(T)];
 };
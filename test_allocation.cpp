@@ -0,0 +1,157 @@
+#include "shared.h"
+#include "weak.h"
+#include "unique.h"
+
+#include <catch.hpp>
+#include <cstddef>
+#include <cstdint>
+#include <new>
+
+struct Frees {
+    size_t size = 0;
+    size_t align = 0;
+};
+
+// Hands out memory from an arena of its own, so anything freed to the wrong place shows up:
+// plain `delete` of an arena pointer trips the sanitizers, and `Deallocate` counts the foreign
+// pointers it gets.
+struct CountingBackend {
+    static inline int allocated = 0;
+    static inline int deallocated = 0;
+    static inline int foreign = 0;
+    static inline Frees last;
+
+    static void* Allocate(size_t size, size_t align) {
+        ++allocated;
+        used = (used + align - 1) / align * align;
+        if (used + size > sizeof(arena)) {
+            throw std::bad_alloc();
+        }
+        void* res = arena + used;
+        used += size;
+        return res;
+    }
+
+    static void Deallocate(void* ptr, size_t size, size_t align) noexcept {
+        ++deallocated;
+        last = {size, align};
+        auto address = static_cast<unsigned char*>(ptr);
+        if (address < arena || address >= arena + used) {
+            ++foreign;
+        }
+    }
+
+    static void Reset() {
+        allocated = deallocated = foreign = 0;
+        last = {};
+    }
+
+private:
+    alignas(64) static inline unsigned char arena[1 << 16];
+    static inline size_t used = 0;
+};
+
+struct Counted {
+    int value = 0;
+};
+
+struct alignas(64) Wide {
+    int value = 0;
+};
+
+struct Polymorphic {
+    virtual ~Polymorphic() = default;
+};
+
+template <>
+struct AllocationBackendFor<Counted> {
+    using Type = CountingBackend;
+};
+
+template <>
+struct AllocationBackendFor<Wide> {
+    using Type = CountingBackend;
+};
+
+template <>
+struct AllocationBackendFor<Polymorphic> {
+    using Type = CountingBackend;
+};
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+static_assert(!kDeletedByCompiler<Counted>);
+static_assert(kDeletedByCompiler<Polymorphic>);
+
+TEST_CASE("Allocation backend") {
+    CountingBackend::Reset();
+
+    SECTION("MakeShared") {
+        {
+            auto ptr = MakeShared<Counted>();
+            REQUIRE(CountingBackend::allocated == 1);
+            WeakPtr<Counted> weak(ptr);
+            ptr.Reset();
+            // The block outlives the object
+            REQUIRE(CountingBackend::deallocated == 0);
+        }
+        REQUIRE(CountingBackend::deallocated == 1);
+        REQUIRE(CountingBackend::last.size > sizeof(Counted));
+    }
+
+    SECTION("Adopted pointers") {
+        {
+            SharedPtr<Counted> ptr(new Counted{5});
+            REQUIRE(ptr->value == 5);
+            // With lazy control blocks there is none until the first copy
+            auto copy = ptr;
+            // Only the block, the object came from plain `new`
+            REQUIRE(CountingBackend::allocated == 1);
+        }
+        REQUIRE(CountingBackend::deallocated == 1);
+        REQUIRE(CountingBackend::last.align == alignof(PointerControlBlock<Counted>));
+
+        {
+            UniquePtr<Counted> unique(new Counted{6});
+            SharedPtr<Counted> lazy(new Counted{7});
+            auto made = MakeUnique<Counted>(8);
+        }
+        REQUIRE(CountingBackend::allocated == 1 + (kLazyBlocks ? 0 : 1));
+    }
+
+    SECTION("New and Delete") {
+        auto ptr = New<Counted>(7);
+        REQUIRE(ptr->value == 7);
+        REQUIRE(CountingBackend::allocated == 1);
+        Delete(ptr);
+        REQUIRE(CountingBackend::deallocated == 1);
+        REQUIRE(CountingBackend::last.size == sizeof(Counted));
+        REQUIRE(CountingBackend::last.align == alignof(Counted));
+    }
+
+    SECTION("Over-aligned") {
+        auto wide = New<Wide>();
+        REQUIRE(reinterpret_cast<uintptr_t>(wide) % 64 == 0);
+        Delete(wide);
+        REQUIRE(CountingBackend::last.align == 64);
+
+        auto shared = MakeShared<Wide>();
+        REQUIRE(reinterpret_cast<uintptr_t>(shared.Get()) % 64 == 0);
+        shared.Reset();
+        REQUIRE(CountingBackend::last.align == 64);
+    }
+
+    SECTION("Virtual destructors") {
+        // The object itself goes through `new` and `delete`
+        Delete(New<Polymorphic>());
+        REQUIRE(CountingBackend::allocated == 0);
+        REQUIRE(CountingBackend::deallocated == 0);
+
+        // Its control block does not
+        { auto ptr = MakeShared<Polymorphic>(); }
+        REQUIRE(CountingBackend::allocated == 1);
+        REQUIRE(CountingBackend::deallocated == 1);
+    }
+
+    REQUIRE(CountingBackend::foreign == 0);
+}
@@ -0,0 +1,112 @@
+#include "borrowed.h"
+#include "weak.h"
+
+#include <catch.hpp>
+
+#include <string>
+#include <type_traits>
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+#ifdef NDEBUG
+static_assert(sizeof(Borrowed<int>) == sizeof(int*));
+static_assert(std::is_trivially_copyable_v<Borrowed<int>>);
+#endif
+static_assert(!std::is_constructible_v<Borrowed<int>, SharedPtr<int>>);
+static_assert(!std::is_constructible_v<Borrowed<int>, UniquePtr<int>>);
+static_assert(!std::is_constructible_v<Borrowed<int>, const SharedPtr<const int>&>);
+static_assert(!std::is_constructible_v<SharedBorrowed<int>, const UniquePtr<int>&>);
+static_assert(std::is_constructible_v<Borrowed<int>, SharedBorrowed<int>>);
+
+size_t Length(Borrowed<const std::string> str) {
+    return str->size();
+}
+
+TEST_CASE("Borrowing") {
+    SECTION("From SharedPtr") {
+        auto sp = MakeShared<std::string>("aba");
+        Borrowed<std::string> borrowed = sp;
+        REQUIRE(borrowed.Get() == sp.Get());
+        REQUIRE(*borrowed == "aba");
+        REQUIRE(Length(sp) == 3);
+        REQUIRE(sp.UseCount() == 1);
+    }
+
+    SECTION("From UniquePtr") {
+        UniquePtr<std::string> up(new std::string("caba"));
+        Borrowed<std::string> borrowed = up;
+        REQUIRE(borrowed.Get() == up.Get());
+        REQUIRE(Length(up) == 4);
+        borrowed->push_back('!');
+        REQUIRE(*up == "caba!");
+    }
+
+    SECTION("From Lock") {
+        auto sp = MakeShared<std::string>("aba");
+        WeakPtr<std::string> weak(sp);
+        auto locked = weak.Lock();
+        REQUIRE(Length(locked) == 3);
+        REQUIRE(sp.UseCount() == 2);
+    }
+
+    SECTION("Follows the owner") {
+        SharedPtr<int> sp;
+        Borrowed<int> borrowed = sp;
+        REQUIRE(!borrowed);
+        sp = MakeShared<int>(42);
+        REQUIRE(*borrowed == 42);
+    }
+}
+
+TEST_CASE("Borrowed to SharedPtr") {
+    auto sp = MakeShared<std::string>("aba");
+    SharedBorrowed<const std::string> borrowed = sp;
+    REQUIRE(Length(borrowed) == 3);
+
+    auto shared = borrowed.ToShared();
+    REQUIRE(sp.UseCount() == 2);
+    REQUIRE(shared.Get() == sp.Get());
+
+    SharedPtr<const std::string> csp = sp;
+    SharedBorrowed<const std::string> cborrowed = csp;
+    REQUIRE(cborrowed.ToShared().Get() == sp.Get());
+    REQUIRE(sp.UseCount() == 3);
+}
+
+#ifndef NDEBUG
+TEST_CASE("Dangling borrows") {
+    SECTION("Owner reset") {
+        auto sp = MakeShared<std::string>("aba");
+        Borrowed<std::string> borrowed = sp;
+        REQUIRE(!borrowed.Dangling());
+        sp.Reset();
+        REQUIRE(borrowed.Dangling());
+    }
+
+    SECTION("Owner out of scope") {
+        auto outer = MakeShared<int>(1);
+        Borrowed<int> borrowed = outer;
+        {
+            auto inner = MakeShared<int>(2);
+            borrowed = inner;
+            auto copy = borrowed;
+            REQUIRE(!copy.Dangling());
+        }
+        REQUIRE(borrowed.Dangling());
+        borrowed = outer;
+        REQUIRE(!borrowed.Dangling());
+        REQUIRE(*borrowed == 1);
+    }
+
+    SECTION("Weak owners do not keep it alive") {
+        auto sp = MakeShared<int>(3);
+        WeakPtr<int> weak(sp);
+        SharedBorrowed<int> borrowed = sp;
+        Borrowed<int> plain = borrowed;
+        sp.Reset();
+        REQUIRE(borrowed.Dangling());
+        REQUIRE(plain.Dangling());
+        REQUIRE(weak.Expired());
+    }
+}
+#endif
@@ -0,0 +1,200 @@
+#include "channel.h"
+
+#include <catch.hpp>
+
+#include <atomic>
+#include <span>
+#include <thread>
+#include <vector>
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+struct Task {
+    static std::atomic<int> alive;
+
+    explicit Task(int id) : id(id) {
+        ++alive;
+    }
+    ~Task() {
+        --alive;
+    }
+
+    int id;
+};
+
+std::atomic<int> Task::alive = 0;
+
+// Stateful deleter, the channel has to carry it along
+struct CountingDeleter {
+    int* deleted = nullptr;
+
+    void operator()(Task* task) const {
+        ++*deleted;
+        delete task;
+    }
+};
+
+TEST_CASE("MPMC channel") {
+    SECTION("Push and pop") {
+        MpmcChannel<Task> channel(3);
+        REQUIRE(channel.Capacity() == 4);
+
+        for (int i = 0; i < 4; ++i) {
+            UniquePtr<Task> task(new Task(i));
+            REQUIRE(channel.TryPush(task));
+            REQUIRE(!task);
+        }
+        UniquePtr<Task> extra(new Task(4));
+        REQUIRE(!channel.TryPush(extra));
+        REQUIRE(extra);
+
+        UniquePtr<Task> out;
+        for (int i = 0; i < 4; ++i) {
+            REQUIRE(channel.TryPop(out));
+            REQUIRE(out->id == i);
+        }
+        REQUIRE(!channel.TryPop(out));
+        REQUIRE(out->id == 3);
+    }
+
+    SECTION("Batches") {
+        MpmcChannel<Task> channel(8);
+        std::vector<UniquePtr<Task>> tasks;
+        for (int i = 0; i < 10; ++i) {
+            tasks.emplace_back(new Task(i));
+        }
+        REQUIRE(channel.TryPushBatch(tasks) == 8);
+        REQUIRE(!tasks[7]);
+        REQUIRE(tasks[8]);
+        REQUIRE(channel.Size() == 8);
+
+        std::vector<UniquePtr<Task>> out(5);
+        REQUIRE(channel.TryPopBatch(out) == 5);
+        REQUIRE(out[4]->id == 4);
+        REQUIRE(channel.TryPopBatch(out) == 3);
+        REQUIRE(out[2]->id == 7);
+        REQUIRE(out[3]->id == 3);
+    }
+
+    SECTION("Deleters and teardown") {
+        int deleted = 0;
+        {
+            MpmcChannel<Task, CountingDeleter> channel(4);
+            for (int i = 0; i < 3; ++i) {
+                UniquePtr<Task, CountingDeleter> task(new Task(i), CountingDeleter{&deleted});
+                channel.TryPush(task);
+            }
+            UniquePtr<Task, CountingDeleter> out;
+            REQUIRE(channel.TryPop(out));
+            REQUIRE(out.GetDeleter().deleted == &deleted);
+            out.Reset();
+            REQUIRE(deleted == 1);
+        }
+        REQUIRE(deleted == 3);
+    }
+
+    REQUIRE(Task::alive == 0);
+}
+
+TEST_CASE("MPMC channel between threads") {
+    constexpr int kProducers = 4;
+    constexpr int kPerProducer = 20000;
+    {
+        MpmcChannel<Task> channel(64);
+        std::atomic<int> consumed = 0;
+        std::atomic<long long> sum = 0;
+        std::vector<std::thread> threads;
+        for (int p = 0; p < kProducers; ++p) {
+            threads.emplace_back([&channel, p] {
+                std::vector<UniquePtr<Task>> batch;
+                for (int i = 0; i < kPerProducer; ++i) {
+                    batch.emplace_back(new Task(p * kPerProducer + i));
+                    if (batch.size() == 7 || i + 1 == kPerProducer) {
+                        std::span<UniquePtr<Task>> rest(batch);
+                        while (!rest.empty()) {
+                            rest = rest.subspan(channel.TryPushBatch(rest));
+                        }
+                        batch.clear();
+                    }
+                }
+            });
+        }
+        for (int c = 0; c < 3; ++c) {
+            threads.emplace_back([&] {
+                std::vector<UniquePtr<Task>> out(5);
+                while (consumed.load() < kProducers * kPerProducer) {
+                    size_t count = channel.TryPopBatch(out);
+                    for (size_t i = 0; i < count; ++i) {
+                        sum += out[i]->id;
+                        out[i].Reset();
+                    }
+                    consumed += static_cast<int>(count);
+                }
+            });
+        }
+        for (auto& thread : threads) {
+            thread.join();
+        }
+        long long n = kProducers * kPerProducer;
+        REQUIRE(sum.load() == n * (n - 1) / 2);
+    }
+    REQUIRE(Task::alive == 0);
+}
+
+TEST_CASE("SPSC channel") {
+    SECTION("Across segments") {
+        SpscChannel<Task> channel;
+        for (int i = 0; i < 1000; ++i) {
+            channel.Push(UniquePtr<Task>(new Task(i)));
+        }
+        UniquePtr<Task> out;
+        for (int i = 0; i < 1000; ++i) {
+            REQUIRE(channel.TryPop(out));
+            REQUIRE(out->id == i);
+        }
+        REQUIRE(!channel.TryPop(out));
+    }
+
+    SECTION("Teardown") {
+        int deleted = 0;
+        {
+            SpscChannel<Task, CountingDeleter> channel;
+            std::vector<UniquePtr<Task, CountingDeleter>> tasks;
+            for (int i = 0; i < 300; ++i) {
+                tasks.emplace_back(new Task(i), CountingDeleter{&deleted});
+            }
+            channel.PushBatch(tasks);
+            std::vector<UniquePtr<Task, CountingDeleter>> out(150);
+            REQUIRE(channel.TryPopBatch(out) == 150);
+            REQUIRE(out[149]->id == 149);
+        }
+        REQUIRE(deleted == 300);
+    }
+
+    SECTION("Between threads") {
+        constexpr int kCount = 100000;
+        SpscChannel<Task> channel;
+        long long sum = 0;
+        bool in_order = true;
+        std::thread consumer([&] {
+            std::vector<UniquePtr<Task>> out(16);
+            int seen = 0;
+            while (seen < kCount) {
+                size_t count = channel.TryPopBatch(out);
+                for (size_t i = 0; i < count; ++i) {
+                    in_order &= out[i]->id == seen + static_cast<int>(i);
+                    sum += out[i]->id;
+                }
+                seen += static_cast<int>(count);
+            }
+        });
+        for (int i = 0; i < kCount; ++i) {
+            channel.Push(UniquePtr<Task>(new Task(i)));
+        }
+        consumer.join();
+        REQUIRE(in_order);
+        REQUIRE(sum == static_cast<long long>(kCount) * (kCount - 1) / 2);
+    }
+
+    REQUIRE(Task::alive == 0);
+}
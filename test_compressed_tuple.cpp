@@ -0,0 +1,72 @@
+#include "compressed_tuple.h"
+#include "unique.h"
+
+#include <catch.hpp>
+#include <cstddef>
+#include <memory>
+#include <string>
+
+struct Empty {};
+struct OtherEmpty {};
+struct FinalEmpty final {};
+
+struct Tagged {
+    Tagged() = default;
+    explicit Tagged(int tag) : tag(tag) {
+    }
+
+    int tag = 0;
+};
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+static_assert(sizeof(CompressedTuple<int*, Empty>) == sizeof(int*));
+static_assert(sizeof(CompressedTuple<int*, Empty, OtherEmpty, size_t>) == 2 * sizeof(int*));
+static_assert(sizeof(CompressedTuple<int*, std::allocator<int>, size_t>) == 2 * sizeof(int*));
+static_assert(sizeof(CompressedTuple<Empty, OtherEmpty>) == 1);
+// Two subobjects of the same type need different addresses
+static_assert(sizeof(CompressedTuple<int*, Empty, Empty>) > sizeof(int*));
+static_assert(sizeof(CompressedTuple<int*, FinalEmpty>) > sizeof(int*));
+
+static_assert(sizeof(UniquePtr<int>) == sizeof(int*));
+static_assert(sizeof(UniquePtr<int[]>) == sizeof(int*));
+static_assert(sizeof(CompressedPair<int*, DefaultDeleter<int>>) == sizeof(int*));
+
+constexpr bool TupleWorks() {
+    CompressedTuple<int, Empty, long, OtherEmpty, char> tuple(1, Empty{}, 2L, OtherEmpty{}, 'a');
+    tuple.Get<0>() += 10;
+    const auto& ref = tuple;
+    return ref.Get<0>() == 11 && ref.Get<2>() == 2 && ref.Get<4>() == 'a';
+}
+
+static_assert(TupleWorks());
+
+TEST_CASE("Compressed tuple") {
+    SECTION("Members") {
+        CompressedTuple<int*, Empty, std::string, Tagged> tuple(nullptr, Empty{}, "abc", Tagged(5));
+        REQUIRE(tuple.Get<0>() == nullptr);
+        REQUIRE(tuple.Get<2>() == "abc");
+        REQUIRE(tuple.Get<3>().tag == 5);
+        tuple.Get<2>() += "def";
+        REQUIRE(tuple.Get<2>() == "abcdef");
+    }
+
+    SECTION("Default") {
+        CompressedTuple<int, std::string, Empty> tuple;
+        REQUIRE(tuple.Get<0>() == 0);
+        REQUIRE(tuple.Get<1>().empty());
+    }
+
+    SECTION("Copy and move") {
+        CompressedTuple<std::string> one("abc");
+        auto copy = one;
+        REQUIRE(copy.Get<0>() == "abc");
+        auto moved = std::move(one);
+        REQUIRE(moved.Get<0>() == "abc");
+
+        CompressedTuple<std::unique_ptr<int>, Empty> owner(std::make_unique<int>(7), Empty{});
+        auto other = std::move(owner);
+        REQUIRE(*other.Get<0>() == 7);
+        REQUIRE(owner.Get<0>() == nullptr);
+    }
+}
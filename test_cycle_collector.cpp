@@ -0,0 +1,166 @@
+#include "cycle_collector.h"
+#include "weak.h"
+
+#include <catch.hpp>
+
+#include <vector>
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+struct Node {
+    static int alive;
+    static int visited;
+
+    Node() {
+        ++alive;
+    }
+    ~Node() {
+        --alive;
+    }
+
+    std::vector<SharedPtr<Node>> children;
+    WeakPtr<Node> parent;
+};
+
+int Node::alive = 0;
+int Node::visited = 0;
+
+template <>
+struct CycleTraits<Node> {
+    static void Visit(Node& node, CycleVisitor& visit) {
+        ++Node::visited;
+        for (auto& child : node.children) {
+            visit(child);
+        }
+        visit(node.parent);
+    }
+};
+
+TEST_CASE("Cycles are collected") {
+    auto& collector = CycleCollector::Instance();
+    collector.Collect();
+    size_t collected = collector.Collected();
+
+    SECTION("Two nodes") {
+        {
+            auto a = MakeCollectable<Node>();
+            auto b = MakeCollectable<Node>();
+            a->children.push_back(b);
+            b->children.push_back(a);
+        }
+        REQUIRE(Node::alive == 2);
+        REQUIRE(collector.Collect() == 2);
+        REQUIRE(Node::alive == 0);
+        REQUIRE(collector.Collected() == collected + 2);
+    }
+
+    SECTION("Self reference") {
+        WeakPtr<Node> weak;
+        {
+            auto a = MakeCollectable<Node>();
+            a->children.push_back(a);
+            weak = a;
+        }
+        REQUIRE(!weak.Expired());
+        collector.Collect();
+        REQUIRE(weak.Expired());
+        REQUIRE(Node::alive == 0);
+    }
+
+    SECTION("Ring with a tail") {
+        {
+            auto head = MakeCollectable<Node>();
+            auto node = head;
+            for (int i = 0; i < 100; ++i) {
+                auto next = MakeCollectable<Node>();
+                next->parent = node;
+                node->children.push_back(next);
+                node = next;
+            }
+            node->children.push_back(head);
+            node->children.push_back(MakeCollectable<Node>());
+        }
+        REQUIRE(Node::alive == 102);
+        collector.Collect();
+        REQUIRE(Node::alive == 0);
+    }
+}
+
+TEST_CASE("Live cycles survive") {
+    auto& collector = CycleCollector::Instance();
+    auto a = MakeCollectable<Node>();
+    {
+        auto b = MakeCollectable<Node>();
+        a->children.push_back(b);
+        b->children.push_back(a);
+    }
+    REQUIRE(collector.Collect() == 0);
+    REQUIRE(Node::alive == 2);
+
+    // Reachable from a cycle, but not a part of one
+    auto plain = MakeShared<Node>();
+    a->children.push_back(plain);
+    plain.Reset();
+    REQUIRE(collector.Collect() == 0);
+    REQUIRE(Node::alive == 3);
+
+    a->children.front()->children.clear();
+    REQUIRE(Node::alive == 3);
+    a.Reset();
+    REQUIRE(Node::alive == 0);
+    collector.Collect();
+}
+
+TEST_CASE("Bounded and automatic collection") {
+    auto& collector = CycleCollector::Instance();
+    collector.Collect();
+
+    SECTION("Bounded") {
+        for (int i = 0; i < 10; ++i) {
+            auto a = MakeCollectable<Node>();
+            a->children.push_back(a);
+        }
+        REQUIRE(collector.Candidates() == 10);
+        REQUIRE(collector.Collect(3) == 3);
+        REQUIRE(collector.Candidates() == 7);
+        REQUIRE(Node::alive == 7);
+        collector.Collect();
+        REQUIRE(Node::alive == 0);
+    }
+
+    SECTION("Threshold") {
+        collector.SetThreshold(5);
+        for (int i = 0; i < 5; ++i) {
+            auto a = MakeCollectable<Node>();
+            a->children.push_back(a);
+        }
+        REQUIRE(Node::alive == 5);
+        auto trigger = MakeCollectable<Node>();
+        REQUIRE(Node::alive == 1);
+        collector.SetThreshold(CycleCollector::kDefaultThreshold);
+    }
+
+    SECTION("Owned roots are not traced") {
+        auto a = MakeCollectable<Node>();
+        a->children.push_back(MakeCollectable<Node>());
+        auto copy = a;
+        copy.Reset();
+        REQUIRE(collector.Candidates() == 1);
+        copy = a;
+        Node::visited = 0;
+        REQUIRE(collector.Collect() == 0);
+        REQUIRE(Node::visited == 0);
+        REQUIRE(collector.Candidates() == 0);
+    }
+
+    SECTION("Buffered root dies on its own") {
+        auto a = MakeCollectable<Node>();
+        auto copy = a;
+        copy.Reset();
+        REQUIRE(collector.Candidates() == 1);
+        a.Reset();
+        REQUIRE(Node::alive == 0);
+        REQUIRE(collector.Collect() == 0);
+        REQUIRE(collector.Candidates() == 0);
+    }
+}
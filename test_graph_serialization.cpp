@@ -0,0 +1,206 @@
+#include "graph_serialization.h"
+
+#include <catch.hpp>
+
+#include <sstream>
+#include <string>
+#include <vector>
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+enum class Kind { kLeaf, kInner };
+
+struct Point {
+    double x = 0;
+    double y = 0;
+};
+
+template <>
+struct GraphTraits<Point> {
+    template <typename Archive>
+    static void Serialize(Archive& ar, Point& point) {
+        ar(point.x, point.y);
+    }
+};
+
+struct Vertex {
+    int id = 0;
+    std::string name;
+    Kind kind = Kind::kLeaf;
+    Point position;
+    std::vector<SharedPtr<Vertex>> edges;
+    WeakPtr<Vertex> parent;
+};
+
+template <>
+struct GraphTraits<Vertex> {
+    template <typename Archive>
+    static void Serialize(Archive& ar, Vertex& vertex) {
+        ar(vertex.id, vertex.name, vertex.kind, vertex.position, vertex.edges, vertex.parent);
+    }
+};
+
+SharedPtr<Vertex> MakeVertex(int id) {
+    auto vertex = MakeShared<Vertex>();
+    vertex->id = id;
+    vertex->name = "v" + std::to_string(id);
+    vertex->position = {id * 0.5, -id * 1.5};
+    return vertex;
+}
+
+TEST_CASE("Graph round trip") {
+    std::stringstream stream;
+
+    SECTION("Shared nodes stay shared") {
+        {
+            // Diamond: root -> a, b -> leaf
+            auto root = MakeVertex(-1);
+            auto a = MakeVertex(1), b = MakeVertex(2), leaf = MakeVertex(3);
+            root->kind = Kind::kInner;
+            root->edges = {a, b};
+            a->edges.push_back(leaf);
+            b->edges.push_back(leaf);
+            a->parent = root;
+            b->parent = root;
+            leaf->parent = a;
+            GraphWriter writer(stream);
+            writer.Write(root);
+        }
+
+        GraphReader reader(stream);
+        auto root = reader.Read<Vertex>();
+        REQUIRE(root->id == -1);
+        REQUIRE(root->kind == Kind::kInner);
+        REQUIRE(root->edges.size() == 2);
+        auto a = root->edges[0], b = root->edges[1];
+        REQUIRE(a->name == "v1");
+        REQUIRE(b->position.y == -3.0);
+        REQUIRE(a->edges[0] == b->edges[0]);
+        REQUIRE(a->parent.Lock() == root);
+        REQUIRE(a->edges[0]->parent.Lock() == a);
+    }
+
+    SECTION("Weak edges stay weak") {
+        {
+            auto owner = MakeVertex(1);
+            auto observed = MakeVertex(2);
+            owner->parent = observed;
+            GraphWriter writer(stream);
+            writer.Write(owner);
+        }
+
+        SharedPtr<Vertex> owner;
+        {
+            GraphReader reader(stream);
+            owner = reader.Read<Vertex>();
+            REQUIRE(owner->parent.Lock()->id == 2);
+        }
+        REQUIRE(owner->parent.Expired());
+        REQUIRE(owner.UseCount() == 1);
+    }
+
+    SECTION("Several roots and cycles") {
+        {
+            auto a = MakeVertex(1), b = MakeVertex(2);
+            a->edges.push_back(b);
+            b->edges.push_back(a);
+            SharedPtr<Vertex> null;
+            GraphWriter writer(stream);
+            writer.Write(a);
+            writer.Write(b);
+            writer.Write(null);
+            b->edges.clear();
+        }
+
+        GraphReader reader(stream);
+        auto a = reader.Read<Vertex>();
+        auto b = reader.Read<Vertex>();
+        REQUIRE(!reader.Read<Vertex>());
+        REQUIRE(a->edges[0] == b);
+        REQUIRE(b->edges[0] == a);
+        b->edges.clear();
+    }
+}
+
+TEST_CASE("Broken graph data") {
+    std::stringstream stream;
+    {
+        auto a = MakeVertex(1);
+        a->edges.push_back(MakeVertex(2));
+        GraphWriter writer(stream);
+        writer.Write(a);
+        writer.Write(a);
+    }
+    auto data = stream.str();
+
+    SECTION("Truncated") {
+        std::stringstream truncated(data.substr(0, data.size() / 2));
+        GraphReader reader(truncated);
+        REQUIRE_THROWS_AS(reader.Read<Vertex>(), BadGraphFormat);
+    }
+
+    SECTION("Dangling id") {
+        std::stringstream dangling;
+        GraphWriter writer(dangling);
+        dangling << '\x05';
+        GraphReader reader(dangling);
+        REQUIRE_THROWS_AS(reader.Read<Vertex>(), BadGraphFormat);
+    }
+
+    SECTION("Foreign data") {
+        std::stringstream foreign("not a graph");
+        REQUIRE_THROWS_AS(GraphReader(foreign), BadGraphFormat);
+        std::stringstream empty;
+        REQUIRE_THROWS_AS(GraphReader(empty), BadGraphFormat);
+    }
+
+    SECTION("Unknown version") {
+        auto future = data;
+        future[4] = '\x02';
+        std::stringstream stream(future);
+        REQUIRE_THROWS_AS(GraphReader(stream), BadGraphFormat);
+    }
+
+    SECTION("Node read as another type") {
+        GraphReader reader(stream);
+        reader.Read<Vertex>();
+        REQUIRE_THROWS_AS(reader.Read<Point>(), BadGraphFormat);
+    }
+}
+
+struct Shape {
+    int sides = 0;
+};
+
+struct Square : Shape {
+    double side = 0;
+};
+
+template <>
+struct GraphTraits<Shape> {
+    template <typename Archive>
+    static void Serialize(Archive& ar, Shape& shape) {
+        ar(shape.sides);
+    }
+};
+
+template <>
+struct GraphTraits<Square> {
+    template <typename Archive>
+    static void Serialize(Archive& ar, Square& square) {
+        ar(square.sides, square.side);
+    }
+};
+
+TEST_CASE("Node reached through different types") {
+    auto square = MakeShared<Square>();
+    SharedPtr<Shape> shape = square;
+    std::stringstream stream;
+    GraphWriter writer(stream);
+    writer.Write(square);
+    REQUIRE_THROWS_AS(writer.Write(shape), GraphTypeMismatch);
+
+    // Only the pointee type has to match, not its constness
+    SharedPtr<const Square> view = square;
+    writer.Write(view);
+}
@@ -0,0 +1,147 @@
+#include "inline_unique.h"
+
+#include <catch.hpp>
+
+#include <memory>
+#include <string>
+#include <vector>
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+namespace {
+
+int alive = 0;
+
+struct Shape {
+    Shape() {
+        ++alive;
+    }
+    Shape(const Shape&) noexcept {
+        ++alive;
+    }
+    virtual ~Shape() {
+        --alive;
+    }
+    virtual double Area() const = 0;
+};
+
+struct Square : Shape {
+    explicit Square(double side) : side(side) {
+    }
+    double Area() const override {
+        return side * side;
+    }
+    double side;
+};
+
+struct Big : Shape {
+    double Area() const override {
+        return 42;
+    }
+    char data[128] = {};
+};
+
+// Throwing move, so it has to live on the heap
+struct Fragile : Shape {
+    Fragile() = default;
+    Fragile(Fragile&&) noexcept(false) {
+    }
+    double Area() const override {
+        return 1;
+    }
+};
+
+struct Named {
+    std::string name = "aba";
+};
+
+// `Shape` is not at the start of the object
+struct Labeled : Named, Square {
+    Labeled() : Square(2) {
+    }
+};
+
+}  // namespace
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+TEST_CASE("Inline storage") {
+    static_assert(InlineUniquePtr<Shape>::kFitsInline<Square>);
+    static_assert(!InlineUniquePtr<Shape>::kFitsInline<Big>);
+    static_assert(!InlineUniquePtr<Shape>::kFitsInline<Fragile>);
+
+    {
+        auto square = MakeInline<Square, Shape>(3);
+        auto big = MakeInline<Big, Shape>();
+        auto fragile = MakeInline<Fragile, Shape>();
+        REQUIRE(square.IsInline());
+        REQUIRE(!big.IsInline());
+        REQUIRE(!fragile.IsInline());
+        REQUIRE(square->Area() == 9);
+        REQUIRE(big->Area() == 42);
+        REQUIRE(alive == 3);
+    }
+    REQUIRE(alive == 0);
+}
+
+TEST_CASE("Inline moves") {
+    SECTION("Relocation") {
+        std::vector<InlineUniquePtr<Shape>> shapes;
+        for (int i = 0; i < 100; ++i) {
+            // Keeps reallocating, so the inline objects keep moving
+            shapes.push_back(MakeInline<Square, Shape>(i));
+        }
+        shapes.push_back(MakeInline<Big, Shape>());
+        for (int i = 0; i < 100; ++i) {
+            REQUIRE(shapes[i]->Area() == i * i);
+            REQUIRE(shapes[i].IsInline());
+        }
+        REQUIRE(alive == 101);
+        shapes.clear();
+        REQUIRE(alive == 0);
+    }
+
+    SECTION("Conversion") {
+        InlineUniquePtr<Shape> shape = MakeInline<Labeled>();
+        REQUIRE(shape.IsInline());
+        REQUIRE(shape->Area() == 4);
+        REQUIRE(static_cast<Labeled*>(shape.Get())->name == "aba");
+
+        // Fits in 48 bytes, but not in 16
+        InlineUniquePtr<Shape, 16> small = std::move(shape);
+        REQUIRE(!shape);
+        REQUIRE(!small.IsInline());
+        REQUIRE(static_cast<Labeled*>(small.Get())->name == "aba");
+        REQUIRE(alive == 1);
+    }
+
+    SECTION("Swap and reset") {
+        auto a = MakeInline<Square, Shape>(1);
+        auto b = MakeInline<Big, Shape>();
+        a.Swap(b);
+        REQUIRE(a->Area() == 42);
+        REQUIRE(b->Area() == 1);
+        b.Reset(new Square(5));
+        REQUIRE(!b.IsInline());
+        REQUIRE(b->Area() == 25);
+        a = nullptr;
+        REQUIRE(alive == 1);
+    }
+    REQUIRE(alive == 0);
+}
+
+TEST_CASE("Inline release") {
+    auto inline_shape = MakeInline<Labeled, Shape>();
+    auto heap_shape = MakeInline<Big, Shape>();
+    std::unique_ptr<Shape> a(inline_shape.Release());
+    std::unique_ptr<Shape> b(heap_shape.Release());
+    REQUIRE(!inline_shape);
+    REQUIRE(!heap_shape);
+    REQUIRE(a->Area() == 4);
+    REQUIRE(static_cast<Labeled*>(a.get())->name == "aba");
+    REQUIRE(b->Area() == 42);
+    REQUIRE(alive == 2);
+    a.reset();
+    b.reset();
+    REQUIRE(alive == 0);
+}
@@ -0,0 +1,155 @@
+#ifndef SMART_POINTERS_LAZY_BLOCKS
+#define SMART_POINTERS_LAZY_BLOCKS
+#endif
+
+#include "shared.h"
+#include "weak.h"
+#include "weak_key_map.h"
+
+#include <catch.hpp>
+
+#include "allocations_checker.h"
+
+#include <thread>
+#include <utility>
+#include <vector>
+
+struct Base {
+    virtual ~Base() = default;
+};
+
+struct Derived : Base {
+    static int alive;
+
+    Derived() {
+        ++alive;
+    }
+    ~Derived() override {
+        --alive;
+    }
+};
+
+int Derived::alive = 0;
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+TEST_CASE("Lazy control blocks") {
+    SECTION("Never shared") {
+        auto object = new Derived;
+        EXPECT_ZERO_ALLOCATIONS({
+            SharedPtr<Derived> sp(object);
+            auto moved = std::move(sp);
+            SharedPtr<Derived> other;
+            other = std::move(moved);
+            REQUIRE(other.UseCount() == 1);
+        });
+        REQUIRE(Derived::alive == 0);
+    }
+
+    SECTION("First copy") {
+        SharedPtr<Derived> sp(new Derived);
+        SharedPtr<Derived> copy;
+        EXPECT_ONE_ALLOCATION(copy = sp);
+        REQUIRE(sp.UseCount() == 2);
+        EXPECT_ZERO_ALLOCATIONS(SharedPtr<Derived> other = sp);
+        sp.Reset();
+        REQUIRE(Derived::alive == 1);
+        copy.Reset();
+        REQUIRE(Derived::alive == 0);
+    }
+
+    SECTION("First WeakPtr") {
+        SharedPtr<Derived> sp(new Derived);
+        WeakPtr<Derived> weak;
+        EXPECT_ONE_ALLOCATION(weak = sp);
+        REQUIRE(weak.Lock() == sp);
+        sp.Reset();
+        REQUIRE(weak.Expired());
+        REQUIRE(Derived::alive == 0);
+    }
+
+    SECTION("Conversions") {
+        SharedPtr<Derived> sp(new Derived);
+        SharedPtr<Base> base = std::move(sp);
+        REQUIRE(base.UseCount() == 1);
+        base.Reset();
+        REQUIRE(Derived::alive == 0);
+
+        SharedPtr<Derived> owner(new Derived);
+        SharedPtr<void> erased = owner;
+        REQUIRE(erased.Holds<Derived>());
+        owner.Reset();
+        erased.Reset();
+        REQUIRE(Derived::alive == 0);
+    }
+
+    SECTION("Owner comparison") {
+        SharedPtr<Derived> first(new Derived);
+        SharedPtr<Derived> second(new Derived);
+        WeakKeyMap<Derived, int> map;
+        EXPECT_ZERO_ALLOCATIONS({
+            REQUIRE(first.Holds<Derived>());
+            REQUIRE(!first.Holds<Base>());
+            REQUIRE(map.Find(first) == nullptr);
+            REQUIRE(!map.Erase(second));
+        });
+
+        // The owner key is the block, so asking for it makes one, and it does not change later
+        size_t hash;
+        EXPECT_ONE_ALLOCATION(hash = first.OwnerHash());
+        auto copy = first;
+        REQUIRE(first.OwnerHash() == hash);
+        REQUIRE(copy.OwnerHash() == hash);
+        REQUIRE(first.OwnerEqual(first));
+        REQUIRE(first.OwnerEqual(copy));
+        REQUIRE(!first.OwnerEqual(second));
+        REQUIRE(first.OwnerBefore(second) != second.OwnerBefore(first));
+
+        WeakPtr<Derived> weak;
+        EXPECT_ZERO_ALLOCATIONS(weak = first);
+        REQUIRE(first.OwnerHash() == weak.OwnerHash());
+        REQUIRE(first.OwnerEqual(weak));
+        REQUIRE(!second.OwnerEqual(weak));
+        map.Emplace(second, 2);
+        REQUIRE(*map.Find(second) == 2);
+    }
+
+    SECTION("Bulk release") {
+        std::vector<SharedPtr<Derived>> ptrs;
+        for (int i = 0; i < 100; ++i) {
+            ptrs.emplace_back(new Derived);
+            if (i % 3 == 0) {
+                ptrs.push_back(ptrs.back());
+            }
+        }
+        ReleaseAll(ptrs);
+        REQUIRE(Derived::alive == 0);
+    }
+}
+
+#ifdef SMART_POINTERS_THREADED
+
+TEST_CASE("Concurrent first copies") {
+    for (int round = 0; round < 100; ++round) {
+        const SharedPtr<Derived> sp(new Derived);
+        std::vector<std::vector<SharedPtr<Derived>>> copies(4);
+        std::vector<std::thread> threads;
+        for (auto& mine : copies) {
+            threads.emplace_back([&sp, &mine] {
+                for (int i = 0; i < 10; ++i) {
+                    mine.push_back(sp);
+                }
+            });
+        }
+        for (auto& thread : threads) {
+            thread.join();
+        }
+        REQUIRE(sp.UseCount() == 41);
+        for (auto& mine : copies) {
+            REQUIRE(mine.front().OwnerEqual(sp));
+        }
+    }
+    REQUIRE(Derived::alive == 0);
+}
+
+#endif
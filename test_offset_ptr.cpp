@@ -0,0 +1,201 @@
+#include "offset_ptr.h"
+
+#include <catch.hpp>
+
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <string>
+#include <system_error>
+#include <vector>
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+namespace {
+
+struct Node {
+    int value;
+    MappedUniquePtr<Node> left;
+    MappedUniquePtr<Node> right;
+};
+
+struct Index {
+    uint64_t size;
+    OffsetPtr<int> keys;
+    MappedUniquePtr<Node> tree;
+};
+
+MappedUniquePtr<Node> Build(MappedArena& arena, int from, int to) {
+    if (from >= to) {
+        return nullptr;
+    }
+    int mid = from + (to - from) / 2;
+    auto node = arena.MakeUnique<Node>();
+    node->value = mid;
+    node->left = Build(arena, from, mid);
+    node->right = Build(arena, mid + 1, to);
+    return node;
+}
+
+int Sum(const Node* node) {
+    return node ? node->value + Sum(node->left.Get()) + Sum(node->right.Get()) : 0;
+}
+
+std::string TempPath(const char* name) {
+    return (std::filesystem::temp_directory_path() / name).string();
+}
+
+}  // namespace
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+TEST_CASE("OffsetPtr") {
+    SECTION("Basics") {
+        int x = 42;
+        OffsetPtr<int> empty;
+        OffsetPtr<int> ptr = &x;
+        REQUIRE(!empty);
+        REQUIRE(empty.Get() == nullptr);
+        REQUIRE(ptr.Get() == &x);
+        REQUIRE(*ptr == 42);
+        ptr = nullptr;
+        REQUIRE(!ptr);
+    }
+
+    SECTION("Copies point to the same object") {
+        int x = 42;
+        OffsetPtr<int> a = &x;
+        std::vector<OffsetPtr<int>> copies(10, a);
+        for (const auto& copy : copies) {
+            REQUIRE(copy.Get() == &x);
+        }
+    }
+
+    SECTION("Relocation keeps internal links") {
+        struct Block {
+            int values[4];
+            OffsetPtr<int> third;
+        };
+        static_assert(sizeof(OffsetPtr<int>) == 8);
+
+        Block a{{1, 2, 3, 4}, nullptr};
+        a.third = &a.values[2];
+        // What mapping the same bytes at another address amounts to
+        Block b;
+        std::memcpy(static_cast<void*>(&b), &a, sizeof(Block));
+        REQUIRE(b.third.Get() == &b.values[2]);
+        a.values[2] = 0;
+        REQUIRE(*b.third == 3);
+    }
+
+    SECTION("Points to the object it is the first member of") {
+        struct Ring {
+            OffsetPtr<Ring> next;
+            int value = 7;
+        };
+        Ring single;
+        single.next = &single;
+        REQUIRE(single.next);
+        REQUIRE(single.next->value == 7);
+
+        Ring moved;
+        std::memcpy(static_cast<void*>(&moved), &single, sizeof(Ring));
+        REQUIRE(moved.next.Get() == &moved);
+    }
+}
+
+TEST_CASE("MappedUniquePtr") {
+    int x = 1;
+    int y = 2;
+    MappedUniquePtr<int> a(&x);
+    MappedUniquePtr<int> b = std::move(a);
+    REQUIRE(!a);
+    REQUIRE(b.Get() == &x);
+
+    a.Reset(&y);
+    a.Swap(b);
+    REQUIRE(*a == 1);
+    REQUIRE(*b == 2);
+
+    b = std::move(a);
+    REQUIRE(*b == 1);
+    REQUIRE(b.Release() == &x);
+    REQUIRE(!b);
+}
+
+TEST_CASE("Mapped files") {
+    auto path = TempPath("smart_pointers_test_offset_ptr.bin");
+
+    {
+        MappedArena arena(path, 1 << 20);
+        auto index = arena.New<Index>();
+        index->size = 100;
+        auto keys = arena.NewArray<int>(index->size);
+        for (int i = 0; i < 100; ++i) {
+            keys[i] = i * i;
+        }
+        index->keys = keys;
+        index->tree = Build(arena, 0, 1000);
+        arena.SetRoot(index);
+    }
+
+    SECTION("Read back in place") {
+        MappedFile file(path);
+        const auto& index = file.Root<Index>();
+        REQUIRE(index.size == 100);
+        REQUIRE(index.keys[99] == 99 * 99);
+        REQUIRE(Sum(index.tree.Get()) == 999 * 1000 / 2);
+
+        // Every pointer is inside of the mapping
+        auto begin = reinterpret_cast<const char*>(&index);
+        REQUIRE(reinterpret_cast<const char*>(index.tree.Get()) > begin);
+        REQUIRE(reinterpret_cast<const char*>(index.tree.Get()) < begin + file.Size());
+    }
+
+    SECTION("Hints") {
+        MappedFile file(path, MappedFile::Advice::kRandom);
+        file.Advise(MappedFile::Advice::kWillNeed, 100, 1000);
+        file.Advise(MappedFile::Advice::kSequential);
+        REQUIRE(file.Root<Index>().keys[10] == 100);
+    }
+
+    SECTION("Several mappings of the same file") {
+        MappedFile a(path);
+        MappedFile b(path);
+        REQUIRE(&a.Root<Index>() != &b.Root<Index>());
+        REQUIRE(Sum(a.Root<Index>().tree.Get()) == Sum(b.Root<Index>().tree.Get()));
+    }
+
+    SECTION("Wrong root") {
+        MappedFile file(path);
+        REQUIRE_THROWS_AS(file.Root<int>(), std::system_error);
+    }
+
+    std::filesystem::remove(path);
+}
+
+TEST_CASE("Bad mapped files") {
+    auto path = TempPath("smart_pointers_test_offset_ptr_bad.bin");
+
+    SECTION("Missing") {
+        std::filesystem::remove(path);
+        REQUIRE_THROWS_AS(MappedFile(path), std::system_error);
+    }
+
+    SECTION("Garbage") {
+        {
+            MappedArena arena(path, 64);
+            arena.New<int>(42);
+        }
+        std::filesystem::resize_file(path, 8);
+        REQUIRE_THROWS_AS(MappedFile(path), std::system_error);
+    }
+
+    SECTION("Out of space") {
+        MappedArena arena(path, 64);
+        arena.NewArray<char>(60);
+        REQUIRE_THROWS_AS(arena.New<uint64_t>(), std::bad_alloc);
+    }
+
+    std::filesystem::remove(path);
+}
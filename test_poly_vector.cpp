@@ -0,0 +1,151 @@
+#include "poly_vector.h"
+
+#include <catch.hpp>
+
+#include <string>
+#include <vector>
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// No virtual destructor on purpose, the container has to destroy objects by their real type
+struct Shape {
+    virtual double Area() const = 0;
+
+protected:
+    ~Shape() = default;
+};
+
+struct Square : Shape {
+    explicit Square(double side) : side(side) {
+    }
+
+    double Area() const override {
+        return side * side;
+    }
+
+    double side;
+};
+
+struct Label {
+    std::string text;
+};
+
+// `Shape` is not the first base, so it is not at the start of the object
+struct Tagged : Label, Shape {
+    static int alive;
+
+    Tagged(std::string text, double area) : Label{std::move(text)}, area(area) {
+        ++alive;
+    }
+    Tagged(Tagged&& other) noexcept : Label{std::move(other.text)}, area(other.area) {
+        ++alive;
+    }
+    ~Tagged() {
+        --alive;
+    }
+
+    double Area() const override {
+        return area;
+    }
+
+    double area;
+};
+
+int Tagged::alive = 0;
+
+struct alignas(32) Wide : Shape {
+    double Area() const override {
+        return 1;
+    }
+};
+
+TEST_CASE("PolyVector") {
+    SECTION("Grouped by type") {
+        PolyVector<Shape> shapes;
+        for (int i = 0; i < 10; ++i) {
+            shapes.Emplace<Square>(i);
+            shapes.Emplace<Tagged>(std::to_string(i), i);
+        }
+        shapes.Emplace<Wide>();
+        REQUIRE(shapes.Size() == 21);
+        REQUIRE(shapes.Groups() == 3);
+        REQUIRE(Tagged::alive == 10);
+
+        double total = 0;
+        std::vector<const Shape*> order;
+        for (const auto& shape : shapes) {
+            total += shape.Area();
+            order.push_back(&shape);
+        }
+        REQUIRE(total == 2 * (0 + 1 + 4 + 9 + 16 + 25 + 36 + 49 + 64 + 81) - 285 + 45 + 1);
+        // All squares first, then all tagged ones
+        REQUIRE(dynamic_cast<const Square*>(order[9]));
+        REQUIRE(dynamic_cast<const Tagged*>(order[10]));
+        REQUIRE(reinterpret_cast<uintptr_t>(order[20]) % 32 == 0);
+
+        std::string texts;
+        shapes.ForEachOf<Tagged>([&texts](Tagged& tagged) { texts += tagged.text; });
+        REQUIRE(texts == "0123456789");
+
+        double sum = 0;
+        shapes.ForEach([&sum](Shape& shape) { sum += shape.Area(); });
+        REQUIRE(sum == total);
+    }
+
+    SECTION("Erase") {
+        PolyVector<Shape> shapes;
+        for (int i = 0; i < 5; ++i) {
+            shapes.Emplace<Tagged>(std::to_string(i), i);
+        }
+        // Erase the odd ones
+        for (auto it = shapes.begin(); it != shapes.end();) {
+            if (static_cast<int>(it->Area()) % 2 == 1) {
+                it = shapes.Erase(it);
+            } else {
+                ++it;
+            }
+        }
+        REQUIRE(shapes.Size() == 3);
+        REQUIRE(Tagged::alive == 3);
+        double sum = 0;
+        for (auto& shape : shapes) {
+            sum += shape.Area();
+        }
+        REQUIRE(sum == 0 + 2 + 4);
+    }
+
+    SECTION("Extract") {
+        PolyVector<Shape> shapes;
+        shapes.Emplace<Square>(2);
+        shapes.Emplace<Tagged>("tagged", 7);
+        shapes.Emplace<Tagged>("other", 8);
+
+        auto it = shapes.begin();
+        ++it;
+        PolyVector<Shape>::Owner owner = shapes.Extract(it);
+        REQUIRE(owner->Area() == 7);
+        REQUIRE(shapes.Size() == 2);
+        REQUIRE(Tagged::alive == 2);
+
+        owner.Reset();
+        REQUIRE(Tagged::alive == 1);
+    }
+
+    SECTION("Clear and reuse") {
+        PolyVector<Shape> shapes;
+        for (int i = 0; i < 100; ++i) {
+            shapes.Emplace<Tagged>("x", i);
+        }
+        shapes.Clear();
+        REQUIRE(shapes.Empty());
+        REQUIRE(Tagged::alive == 0);
+        REQUIRE(shapes.begin() == shapes.end());
+
+        shapes.Emplace<Tagged>("y", 1);
+        auto moved = std::move(shapes);
+        REQUIRE(moved.Size() == 1);
+        REQUIRE(moved.begin()->Area() == 1);
+    }
+
+    REQUIRE(Tagged::alive == 0);
+}
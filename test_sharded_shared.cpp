@@ -0,0 +1,136 @@
+#include "sharded_shared.h"
+#include "weak.h"
+
+#include <catch.hpp>
+
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+namespace {
+
+struct Counted {
+    explicit Counted(std::atomic<int>* destroyed) : destroyed(destroyed) {
+    }
+
+    ~Counted() {
+        ++*destroyed;
+    }
+
+    std::atomic<int>* destroyed;
+};
+
+using Block = ShardedControlBlock<Counted>;
+
+}  // namespace
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+TEST_CASE("Sharded counts") {
+    std::atomic<int> destroyed = 0;
+
+    SECTION("Few owners stay exact") {
+        auto sp = MakeShardedShared<std::string>("aba");
+        auto copy = sp;
+        REQUIRE(*copy == "aba");
+        REQUIRE(sp.UseCount() == 2);
+        copy.Reset();
+        REQUIRE(sp.UseCount() == 1);
+    }
+
+    SECTION("Many owners") {
+        auto sp = MakeShardedShared<Counted>(&destroyed);
+        WeakPtr<Counted> weak = sp;
+        std::vector<SharedPtr<Counted>> copies(Block::kEnableAt * 2, sp);
+        REQUIRE(sp.UseCount() == copies.size() + 1);
+
+        // Go back and forth across the threshold
+        for (int round = 0; round < 3; ++round) {
+            copies.resize(1);
+            REQUIRE(sp.UseCount() == 2);
+            copies.resize(Block::kEnableAt * 2, sp);
+        }
+        REQUIRE(weak.Lock());
+
+        copies.clear();
+        sp.Reset();
+        REQUIRE(destroyed == 1);
+        REQUIRE(weak.Expired());
+        REQUIRE(!weak.Lock());
+    }
+
+    SECTION("Bulk sharing") {
+        auto sp = MakeShardedShared<Counted>(&destroyed);
+        std::vector<SharedPtr<Counted>> copies;
+        sp.ShareN(Block::kEnableAt * 2, std::back_inserter(copies));
+        sp.Reset();
+        while (!copies.empty()) {
+            copies.pop_back();
+            REQUIRE(destroyed == (copies.empty() ? 1 : 0));
+        }
+    }
+}
+
+#ifdef SMART_POINTERS_THREADED
+
+TEST_CASE("Concurrent sharded owners") {
+    constexpr int kThreads = 8;
+    std::atomic<int> destroyed = 0;
+
+    for (int iteration = 0; iteration < 20; ++iteration) {
+        auto global = MakeShardedShared<Counted>(&destroyed);
+        WeakPtr<Counted> weak = global;
+        std::atomic<int> started = 0;
+        std::atomic<int> failed_locks = 0;
+
+        std::vector<std::thread> threads;
+        for (int i = 0; i < kThreads; ++i) {
+            // Every thread gets its own owner and races the others to the last release
+            threads.emplace_back([&started, &failed_locks, &weak, sp = global] {
+                ++started;
+                while (started < kThreads) {
+                    std::this_thread::yield();
+                }
+                std::vector<SharedPtr<Counted>> held;
+                for (int j = 0; j < 20000; ++j) {
+                    held.push_back(sp);
+                    if (held.size() > 100) {
+                        held.clear();
+                    }
+                    if (j % 100 == 0 && !weak.Lock()) {
+                        ++failed_locks;
+                    }
+                }
+            });
+        }
+        global.Reset();
+        for (auto& thread : threads) {
+            thread.join();
+        }
+        REQUIRE(failed_locks == 0);
+        REQUIRE(destroyed == iteration + 1);
+        REQUIRE(weak.Expired());
+    }
+}
+
+TEST_CASE("Lock races the last release") {
+    std::atomic<int> destroyed = 0;
+    for (int iteration = 0; iteration < 200; ++iteration) {
+        auto sp = MakeShardedShared<Counted>(&destroyed);
+        std::vector<SharedPtr<Counted>> copies(Block::kEnableAt * 2, sp);
+        WeakPtr<Counted> weak = sp;
+        sp.Reset();
+
+        std::thread releaser([&copies] { copies.clear(); });
+        while (weak.Lock()) {
+        }
+        releaser.join();
+        REQUIRE(destroyed == iteration + 1);
+        REQUIRE(weak.Expired());
+    }
+}
+
+#endif
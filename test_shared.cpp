@@ -1,10 +1,16 @@
 #include "shared.h"
+#include "weak.h"
 
 #include <catch.hpp>
 
 #include "allocations_checker.h"
 
+#include <iterator>
+#include <limits>
 #include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////
 
@@ -467,3 +473,331 @@ TEST_CASE("Destructor for correct type") {
         REQUIRE(B::destructor_called);
     }
 }
+
+TEST_CASE("Bulk sharing") {
+    SECTION("ShareN") {
+        auto sp = MakeShared<std::string>("aba");
+        std::vector<SharedPtr<std::string>> subscribers;
+        subscribers.reserve(1000);
+        EXPECT_ZERO_ALLOCATIONS(sp.ShareN(1000, std::back_inserter(subscribers)));
+        REQUIRE(subscribers.size() == 1000);
+        REQUIRE(sp.UseCount() == 1001);
+        REQUIRE(*subscribers.back() == "aba");
+
+        subscribers.clear();
+        REQUIRE(sp.UseCount() == 1);
+    }
+
+    SECTION("Empty") {
+        SharedPtr<int> sp;
+        SharedPtr<int> out[3];
+        REQUIRE(sp.ShareN(3, out) == out + 3);
+        REQUIRE(!out[2]);
+    }
+
+    SECTION("Destination throws") {
+        struct Sink {
+            SharedPtr<int>* data;
+            int* left;
+
+            Sink& operator*() {
+                return *this;
+            }
+            Sink& operator++() {
+                return *this;
+            }
+            Sink& operator=(SharedPtr<int>&& sp) {
+                if ((*left)-- == 0) {
+                    throw 42;
+                }
+                *data++ = std::move(sp);
+                return *this;
+            }
+        };
+
+        auto sp = MakeShared<int>(42);
+        SharedPtr<int> out[5];
+        int left = 2;
+        REQUIRE_THROWS(sp.ShareN(5, Sink{out, &left}));
+        REQUIRE(sp.UseCount() == 3);
+    }
+
+    SECTION("Too many") {
+        auto sp = MakeShared<int>(42);
+        size_t too_many = static_cast<size_t>(std::numeric_limits<int>::max()) + 1;
+        SharedPtr<int>* never_written = nullptr;
+        REQUIRE_THROWS_AS(sp.ShareN(too_many, never_written), std::length_error);
+        WeakPtr<int>* never_written_weak = nullptr;
+        REQUIRE_THROWS_AS(sp.ShareWeakN(too_many, never_written_weak), std::length_error);
+        REQUIRE(sp.UseCount() == 1);
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+struct CountingFree {
+    int* calls;
+
+    void operator()(int* ptr) const {
+        ++*calls;
+        delete ptr;
+    }
+};
+
+struct Shareable : EnableSharedFromThis<Shareable> {
+    explicit Shareable(int value) : value(value) {
+    }
+
+    int value;
+};
+
+TEST_CASE("From UniquePtr") {
+    SECTION("Keeps the deleter") {
+        int calls = 0;
+        UniquePtr<int, CountingFree> up(new int(42), CountingFree{&calls});
+        SharedPtr<int> sp(std::move(up));
+        REQUIRE(!up);
+        REQUIRE(*sp == 42);
+        auto copy = sp;
+        sp.Reset();
+        REQUIRE(calls == 0);
+        copy.Reset();
+        REQUIRE(calls == 1);
+    }
+
+    SECTION("Empty") {
+        UniquePtr<int> up;
+        EXPECT_ZERO_ALLOCATIONS(SharedPtr<int> sp(std::move(up)); REQUIRE(!sp));
+    }
+
+    SECTION("Derived") {
+        Data::data_was_deleted = false;
+        {
+            SharedPtr<const Data> sp(UniquePtr<Data>(new Data{1, 2.0}));
+            REQUIRE(sp->x == 1);
+        }
+        REQUIRE(Data::data_was_deleted);
+    }
+
+    SECTION("Shareable stays unique") {
+        Data::data_was_deleted = false;
+        {
+            auto up = MakeUniqueShareable<Data>(Data{3, 4.0});
+            REQUIRE(up->x == 3);
+            auto other = std::move(up);
+        }
+        REQUIRE(Data::data_was_deleted);
+    }
+
+    SECTION("Shareable gets shared without allocations") {
+        auto up = MakeUniqueShareable<Shareable>(5);
+        REQUIRE_THROWS_AS(up->SharedFromThis(), BadWeakPtr);
+        auto ptr = up.Get();
+        SharedPtr<Shareable> sp;
+        EXPECT_ZERO_ALLOCATIONS(sp = SharedPtr<Shareable>(std::move(up)));
+        REQUIRE(!up);
+        REQUIRE(sp.Get() == ptr);
+        REQUIRE(sp.UseCount() == 1);
+        REQUIRE(sp->SharedFromThis().Get() == ptr);
+        REQUIRE(sp->value == 5);
+    }
+
+    SECTION("Moved-from shareable carries no block") {
+        auto up = MakeUniqueShareable<Data>(Data{6, 7.0});
+        auto other = std::move(up);
+        SharedPtr<Data> empty(std::move(up));
+        REQUIRE(!empty);
+        REQUIRE(empty.UseCount() == 0);
+        WeakPtr<Data> weak(empty);
+        REQUIRE(weak.Expired());
+        REQUIRE(empty.OwnerEqual(SharedPtr<Data>()));
+
+        SharedPtr<Data> sp(std::move(other));
+        REQUIRE(sp->x == 6);
+        REQUIRE(!sp.OwnerEqual(empty));
+    }
+
+    SECTION("Shareable deleter without a block") {
+        Data::data_was_deleted = false;
+        {
+            UniquePtr<Data, ShareableDeleter> up(new Data{8, 9.0});
+            REQUIRE(up->x == 8);
+        }
+        REQUIRE(Data::data_was_deleted);
+
+        Data::data_was_deleted = false;
+        {
+            UniquePtr<Data, ShareableDeleter> up(new Data{10, 11.0});
+            SharedPtr<Data> sp(std::move(up));
+            REQUIRE(!up);
+            REQUIRE(sp->x == 10);
+            REQUIRE(sp.UseCount() == 1);
+        }
+        REQUIRE(Data::data_was_deleted);
+
+        // `Reset` after a shareable object does not reuse its block
+        auto shareable = MakeUniqueShareable<Data>(Data{12, 13.0});
+        shareable.Reset(new Data{14, 15.0});
+        REQUIRE(shareable->x == 14);
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+TEST_CASE("SharedPtr<void>") {
+    SECTION("Right destructor") {
+        Data::data_was_deleted = false;
+        {
+            std::vector<SharedPtr<void>> resources;
+            resources.push_back(MakeShared<Data>(Data{1, 2.0}));
+            resources.push_back(SharedPtr<void>(new std::string("abc")));
+            resources.emplace_back(MakeShared<std::vector<int>>(3, 4));
+            SharedPtr<const void> view = resources[0];
+            REQUIRE(view.UseCount() == 2);
+            REQUIRE(StaticPointerCast<const Data>(view)->y == 2.0);
+            REQUIRE(*StaticPointerCast<std::string>(resources[1]) == "abc");
+        }
+        REQUIRE(Data::data_was_deleted);
+    }
+
+    SECTION("Back and forth") {
+        auto sp = MakeShared<int>(42);
+        SharedPtr<void> erased = sp;
+        REQUIRE(erased.Get() == sp.Get());
+        auto back = StaticPointerCast<int>(erased);
+        REQUIRE(back == sp);
+        REQUIRE(sp.UseCount() == 3);
+    }
+
+    SECTION("Checked casts") {
+        SharedPtr<void> number = MakeShared<int>(42);
+        SharedPtr<const void> text = SharedPtr<std::string>(new std::string("abc"));
+        REQUIRE(number.Holds<int>());
+        REQUIRE(!number.Holds<long>());
+        REQUIRE(text.Holds<std::string>());
+        REQUIRE(text.Holds<const std::string>());
+
+        REQUIRE(*CheckedPointerCast<int>(number) == 42);
+        REQUIRE(!CheckedPointerCast<std::string>(number));
+        REQUIRE(CheckedPointerCast<const std::string>(text)->size() == 3);
+        REQUIRE(!CheckedPointerCast<const int>(text));
+        REQUIRE(!CheckedPointerCast<int>(SharedPtr<void>()));
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+class Other : public Base {};
+
+TEST_CASE("Pointer casts") {
+    SECTION("Copying") {
+        SharedPtr<Base> base = MakeShared<Derived>();
+        auto derived = StaticPointerCast<Derived>(base);
+        REQUIRE(derived.Get() == base.Get());
+        REQUIRE(base.UseCount() == 2);
+        auto dynamic = DynamicPointerCast<Derived>(base);
+        REQUIRE(dynamic == base);
+        REQUIRE(!DynamicPointerCast<Other>(base));
+        REQUIRE(base.UseCount() == 3);
+
+        SharedPtr<const Base> const_base = base;
+        SharedPtr<Base> mutable_base = ConstPointerCast<Base>(const_base);
+        REQUIRE(mutable_base == base);
+        REQUIRE(base.UseCount() == 5);
+    }
+
+    SECTION("Stealing") {
+        auto sp = MakeShared<int>(42);
+        auto ptr = sp.Get();
+        SharedPtr<const int> csp = sp;
+
+        auto back = ConstPointerCast<int>(std::move(csp));
+        REQUIRE(!csp);
+        REQUIRE(back.Get() == ptr);
+        REQUIRE(sp.UseCount() == 2);
+
+        auto bytes = ReinterpretPointerCast<char>(std::move(back));
+        REQUIRE(!back);
+        REQUIRE(bytes.Get() == reinterpret_cast<char*>(ptr));
+        REQUIRE(sp.UseCount() == 2);
+
+        auto number = StaticPointerCast<int>(StaticPointerCast<void>(std::move(bytes)));
+        REQUIRE(*number == 42);
+        REQUIRE(sp.UseCount() == 2);
+    }
+
+    SECTION("Stealing dynamic") {
+        Derived::i_was_deleted = false;
+        {
+            SharedPtr<Base> base(new Derived);
+            auto other = DynamicPointerCast<Other>(std::move(base));
+            REQUIRE(!other);
+            REQUIRE(base.UseCount() == 1);
+
+            auto derived = DynamicPointerCast<Derived>(std::move(base));
+            REQUIRE(!base);
+            REQUIRE(derived.UseCount() == 1);
+            REQUIRE(!Derived::i_was_deleted);
+        }
+        REQUIRE(Derived::i_was_deleted);
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+struct Counted {
+    static int alive;
+
+    Counted() {
+        ++alive;
+    }
+    ~Counted() {
+        --alive;
+    }
+};
+
+int Counted::alive = 0;
+
+TEST_CASE("Bulk release") {
+    SECTION("Everything goes") {
+        std::vector<SharedPtr<Counted>> ptrs;
+        for (int i = 0; i < 1000; ++i) {
+            ptrs.push_back(MakeShared<Counted>());
+            // Runs of copies of one object
+            for (int j = 0; j < i % 3; ++j) {
+                ptrs.push_back(ptrs.back());
+            }
+            if (i % 7 == 0) {
+                ptrs.emplace_back();
+            }
+            if (i % 11 == 0) {
+                ptrs.push_back(SharedPtr<Counted>(new Counted));
+            }
+        }
+        REQUIRE(Counted::alive > 1000);
+        ReleaseAll(ptrs);
+        REQUIRE(ptrs.empty());
+        REQUIRE(Counted::alive == 0);
+    }
+
+    SECTION("Survivors") {
+        auto kept = MakeShared<Counted>();
+        WeakPtr<Counted> watched;
+        std::vector<SharedPtr<Counted>> ptrs(100, kept);
+        {
+            auto other = MakeShared<Counted>();
+            watched = other;
+            ptrs.insert(ptrs.begin() + 50, 10, other);
+            ptrs.push_back(kept);
+        }
+        REQUIRE(kept.UseCount() == 102);
+        ReleaseAll(std::span<SharedPtr<Counted>>(ptrs.data(), 60));
+        REQUIRE(kept.UseCount() == 52);
+        REQUIRE(watched.Expired());
+        REQUIRE(Counted::alive == 1);
+        REQUIRE(!ptrs[59]);
+        REQUIRE(ptrs[60] == kept);
+        ReleaseAll(ptrs);
+        REQUIRE(kept.UseCount() == 1);
+    }
+}
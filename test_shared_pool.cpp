@@ -0,0 +1,221 @@
+#include "shared_pool.h"
+#include "weak.h"
+
+#include <catch.hpp>
+
+#include <atomic>
+#include <thread>
+#include <vector>
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+struct Message {
+    static int alive;
+
+    Message() {
+        ++alive;
+    }
+    ~Message() {
+        --alive;
+    }
+
+    int payload = 0;
+};
+
+int Message::alive = 0;
+
+TEST_CASE("Pool reuses objects") {
+    SECTION("Same object comes back") {
+        SharedPool<Message> pool;
+        Message* first;
+        {
+            auto msg = pool.Acquire();
+            first = msg.Get();
+            REQUIRE(msg.UseCount() == 1);
+        }
+        REQUIRE(Message::alive == 1);
+        REQUIRE(pool.Idle() == 1);
+
+        auto msg = pool.Acquire();
+        REQUIRE(msg.Get() == first);
+        REQUIRE(msg.UseCount() == 1);
+        REQUIRE(pool.Idle() == 0);
+        REQUIRE(pool.Stats().reused == 1);
+    }
+    REQUIRE(Message::alive == 0);
+
+    SECTION("Reset hook") {
+        SharedPool<Message> pool(SharedPool<Message>::kUnbounded,
+                                 [](Message& msg) { msg.payload = 0; });
+        {
+            auto msg = pool.Acquire();
+            msg->payload = 42;
+            auto copy = msg;
+        }
+        REQUIRE(pool.Acquire()->payload == 0);
+    }
+
+    SECTION("Stats") {
+        SharedPool<Message> pool;
+        for (int i = 0; i < 10; ++i) {
+            auto msg = pool.Acquire();
+        }
+        auto stats = pool.Stats();
+        REQUIRE(stats.acquired == 10);
+        REQUIRE(stats.reused == 9);
+        REQUIRE(stats.recycled == 10);
+        REQUIRE(stats.discarded == 0);
+        REQUIRE(stats.ReuseRate() == Approx(0.9));
+    }
+}
+
+TEST_CASE("Pool capacity") {
+    {
+        SharedPool<Message> pool(2);
+        {
+            std::vector<SharedPtr<Message>> msgs;
+            for (int i = 0; i < 5; ++i) {
+                msgs.push_back(pool.Acquire());
+            }
+            REQUIRE(Message::alive == 5);
+        }
+        REQUIRE(Message::alive == 2);
+        REQUIRE(pool.Idle() == 2);
+        REQUIRE(pool.Stats().discarded == 3);
+    }
+    REQUIRE(Message::alive == 0);
+}
+
+TEST_CASE("Pool and WeakPtr") {
+    SharedPool<Message> pool;
+    WeakPtr<Message> weak;
+    Message* first;
+    {
+        auto msg = pool.Acquire();
+        first = msg.Get();
+        weak = msg;
+    }
+    REQUIRE(weak.Expired());
+    REQUIRE(pool.Idle() == 0);
+
+    // Still pinned by `weak`, so it must not be handed out again
+    auto other = pool.Acquire();
+    REQUIRE(other.Get() != first);
+
+    weak.Reset();
+    REQUIRE(pool.Idle() == 1);
+    REQUIRE(pool.Acquire().Get() == first);
+}
+
+TEST_CASE("Pool dies before its objects") {
+    SharedPtr<Message> msg;
+    {
+        SharedPool<Message> pool;
+        msg = pool.Acquire();
+        pool.Acquire();
+    }
+    REQUIRE(Message::alive == 1);
+    msg->payload = 1;
+    msg.Reset();
+    REQUIRE(Message::alive == 0);
+}
+
+TEST_CASE("Pool is shared between threads") {
+    {
+        SharedPool<Message> pool(1000);
+        std::vector<std::thread> threads;
+        for (int i = 0; i < 4; ++i) {
+            threads.emplace_back([&pool] {
+                std::vector<SharedPtr<Message>> batch;
+                for (int j = 0; j < 1000; ++j) {
+                    batch.push_back(pool.Acquire());
+                    if (batch.size() == 100) {
+                        batch.clear();
+                    }
+                }
+            });
+        }
+        for (auto& thread : threads) {
+            thread.join();
+        }
+        auto stats = pool.Stats();
+        REQUIRE(stats.acquired == 4000);
+        REQUIRE(stats.reused > 0);
+        REQUIRE(stats.recycled + stats.discarded == 4000);
+    }
+    REQUIRE(Message::alive == 0);
+}
+
+TEST_CASE("Thread caches do not hoard the pool") {
+    constexpr size_t kCount = 1000;
+    constexpr size_t kCache = SharedPoolCore<Message>::kThreadCacheSize;
+    {
+        SharedPool<Message> pool;
+        std::vector<SharedPtr<Message>> batch;
+        for (size_t i = 0; i < kCount; ++i) {
+            batch.push_back(pool.Acquire());
+        }
+        batch.clear();
+
+        // Another thread takes one object and keeps its cache while we go for the rest
+        std::atomic<bool> taken = false;
+        std::atomic<bool> done = false;
+        std::thread other([&] {
+            auto msg = pool.Acquire();
+            taken = true;
+            while (!done) {
+                std::this_thread::yield();
+            }
+        });
+        while (!taken) {
+            std::this_thread::yield();
+        }
+
+        size_t reused = pool.Stats().reused;
+        for (size_t i = 0; i < kCount - 1; ++i) {
+            batch.push_back(pool.Acquire());
+        }
+        reused = pool.Stats().reused - reused;
+        done = true;
+        other.join();
+
+        REQUIRE(reused >= kCount - 1 - kCache);
+        REQUIRE(Message::alive <= static_cast<int>(kCount + kCache));
+    }
+    REQUIRE(Message::alive == 0);
+}
+
+TEST_CASE("Closed pool leaves other thread caches") {
+    std::atomic<int> step = 0;
+    auto wait_for = [&step](int value) {
+        while (step != value) {
+            std::this_thread::yield();
+        }
+    };
+    int alive_after_close = 0;
+    int alive_after_touch = 0;
+    {
+        auto pool = new SharedPool<Message>();
+        std::thread other([&] {
+            // The second one binds this thread's cache to the pool and ends up in it
+            pool->Acquire();
+            pool->Acquire();
+            step = 1;
+            wait_for(2);
+            // Touching any pool of `Message` lets go of the closed one
+            SharedPool<Message> another;
+            auto msg = another.Acquire();
+            alive_after_touch = Message::alive;
+            step = 3;
+        });
+        wait_for(1);
+        delete pool;
+        alive_after_close = Message::alive;
+        step = 2;
+        wait_for(3);
+        other.join();
+    }
+    REQUIRE(alive_after_close == 1);
+    REQUIRE(alive_after_touch == 1);
+    REQUIRE(Message::alive == 0);
+}
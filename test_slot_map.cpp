@@ -0,0 +1,145 @@
+#include "slot_map.h"
+
+#include <catch.hpp>
+
+#include <random>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+struct Entity {
+    std::string name;
+    float x = 0;
+};
+
+static_assert(sizeof(Handle<Entity>) == 8);
+
+TEST_CASE("Slot map") {
+    SlotMap<Entity> map;
+
+    SECTION("Handles expire") {
+        auto first = map.Emplace("first", 1.0f);
+        auto second = map.Emplace("second", 2.0f);
+        REQUIRE(map.Size() == 2);
+        REQUIRE(map.Get(first)->name == "first");
+        REQUIRE(map.Get(second)->x == 2.0f);
+
+        REQUIRE(map.Erase(first));
+        REQUIRE(!map.Erase(first));
+        REQUIRE(map.Expired(first));
+        REQUIRE(map.Get(first) == nullptr);
+        REQUIRE(map.Get(second)->name == "second");
+
+        // The slot is reused, the old handle does not see the new object
+        auto third = map.Emplace("third");
+        REQUIRE(third.Index() == first.Index());
+        REQUIRE(third != first);
+        REQUIRE(map.Expired(first));
+        REQUIRE(map.Get(third)->name == "third");
+
+        REQUIRE(map.Expired(Handle<Entity>()));
+        REQUIRE(!Handle<Entity>());
+    }
+
+    SECTION("Dense values") {
+        std::vector<Handle<Entity>> handles;
+        for (int i = 0; i < 10; ++i) {
+            handles.push_back(map.Emplace(std::to_string(i), static_cast<float>(i)));
+        }
+        for (int i = 0; i < 10; i += 2) {
+            map.Erase(handles[i]);
+        }
+        REQUIRE(map.Values().size() == 5);
+        float sum = 0;
+        for (auto& entity : map) {
+            sum += entity.x;
+        }
+        REQUIRE(sum == 1 + 3 + 5 + 7 + 9);
+        for (size_t i = 0; i < map.Size(); ++i) {
+            REQUIRE(map.Get(map.HandleAt(i)) == &map.Values()[i]);
+        }
+    }
+
+    SECTION("Clear") {
+        auto handle = map.Emplace("a");
+        map.Clear();
+        REQUIRE(map.Empty());
+        REQUIRE(map.Expired(handle));
+        auto other = map.Emplace("b");
+        REQUIRE(map.Get(other)->name == "b");
+        REQUIRE(map.Expired(handle));
+    }
+
+    SECTION("Random operations") {
+        std::mt19937 gen(42);
+        std::unordered_map<int, Handle<Entity>> live;
+        std::vector<Handle<Entity>> dead;
+        for (int i = 0; i < 10000; ++i) {
+            if (live.empty() || gen() % 3 != 0) {
+                live[i] = map.Emplace(std::to_string(i));
+            } else {
+                auto it = std::next(live.begin(), gen() % live.size());
+                REQUIRE(map.Erase(it->second));
+                dead.push_back(it->second);
+                live.erase(it);
+            }
+        }
+        REQUIRE(map.Size() == live.size());
+        for (auto [key, handle] : live) {
+            REQUIRE(map.Get(handle)->name == std::to_string(key));
+        }
+        for (auto handle : dead) {
+            REQUIRE(map.Expired(handle));
+        }
+    }
+}
+
+TEST_CASE("Slot owners") {
+    SlotMap<Entity> map;
+
+    SECTION("Erase on destruction") {
+        Handle<Entity> handle;
+        {
+            auto owner = map.EmplaceOwned("owned");
+            handle = owner.GetHandle();
+            REQUIRE(owner->name == "owned");
+            REQUIRE(!map.Expired(handle));
+        }
+        REQUIRE(map.Expired(handle));
+        REQUIRE(map.Empty());
+    }
+
+    SECTION("Moves") {
+        auto owner = map.EmplaceOwned("a");
+        auto moved = std::move(owner);
+        REQUIRE(!owner);
+        REQUIRE(moved->name == "a");
+
+        SlotOwner<Entity> other = map.EmplaceOwned("b");
+        auto b = other.GetHandle();
+        other = std::move(moved);
+        REQUIRE(map.Expired(b));
+        REQUIRE(other->name == "a");
+        REQUIRE(map.Size() == 1);
+    }
+
+    SECTION("Release") {
+        auto owner = map.EmplaceOwned("kept");
+        auto handle = owner.Release();
+        REQUIRE(!owner);
+        owner.Reset();
+        REQUIRE(map.Get(handle)->name == "kept");
+    }
+
+    SECTION("Erased behind the owner's back") {
+        auto owner = map.EmplaceOwned("a");
+        map.Erase(owner.GetHandle());
+        REQUIRE(!owner);
+        auto other = map.EmplaceOwned("b");
+        // Does not erase the new object in the reused slot
+        owner.Reset();
+        REQUIRE(other->name == "b");
+    }
+}
@@ -0,0 +1,107 @@
+// The probes are what is tested here, so they are always on. Without <sys/sdt.h> this file does
+// not compile, see tracing.h, rather than pass without looking at a single probe.
+#ifndef SMART_POINTERS_USDT
+#define SMART_POINTERS_USDT
+#endif
+
+#include "shared.h"
+#include "weak.h"
+#include "unique.h"
+
+#include <catch.hpp>
+
+#include <elf.h>
+
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <set>
+#include <string>
+#include <vector>
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+namespace {
+
+struct Traced {
+    int value = 0;
+};
+
+// Names of the `smart_pointers` probes in the `.note.stapsdt` section of this very binary
+std::set<std::string> ProbesInBinary() {
+    std::ifstream file("/proc/self/exe", std::ios::binary);
+    std::vector<char> image{std::istreambuf_iterator<char>(file), {}};
+    REQUIRE(image.size() > sizeof(Elf64_Ehdr));
+
+    Elf64_Ehdr header;
+    std::memcpy(&header, image.data(), sizeof(header));
+    REQUIRE(std::memcmp(header.e_ident, ELFMAG, SELFMAG) == 0);
+    REQUIRE(header.e_ident[EI_CLASS] == ELFCLASS64);
+
+    std::vector<Elf64_Shdr> sections(header.e_shnum);
+    std::memcpy(sections.data(), image.data() + header.e_shoff,
+                sections.size() * sizeof(Elf64_Shdr));
+    const char* names = image.data() + sections[header.e_shstrndx].sh_offset;
+
+    std::set<std::string> probes;
+    for (const auto& section : sections) {
+        if (section.sh_type != SHT_NOTE ||
+            std::strcmp(names + section.sh_name, ".note.stapsdt") != 0) {
+            continue;
+        }
+        // Note: header, owner name "stapsdt", then pc, base, semaphore, provider, name, arguments
+        const char* note = image.data() + section.sh_offset;
+        const char* end = note + section.sh_size;
+        while (note + sizeof(Elf64_Nhdr) <= end) {
+            Elf64_Nhdr note_header;
+            std::memcpy(&note_header, note, sizeof(note_header));
+            const char* owner = note + sizeof(note_header);
+            const char* desc = owner + ((note_header.n_namesz + 3) & ~3u);
+            if (note_header.n_type == 3 && std::strcmp(owner, "stapsdt") == 0) {
+                const char* provider = desc + 3 * sizeof(uint64_t);
+                const char* name = provider + std::strlen(provider) + 1;
+                if (std::strcmp(provider, "smart_pointers") == 0) {
+                    probes.insert(name);
+                }
+            }
+            note = desc + ((note_header.n_descsz + 3) & ~3u);
+        }
+    }
+    return probes;
+}
+
+}  // namespace
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+static_assert(TypeName<int>() == "int");
+static_assert(TypeName<Traced>().ends_with("::Traced"));
+static_assert(TypeName<std::vector<int>>().starts_with("std::vector<int"));
+static_assert(kTypeNameHash<int> != kTypeNameHash<long>);
+static_assert(kTypeNameHash<const int> != kTypeNameHash<int>);
+static_assert(ProbeSize<void>() == 0);
+static_assert(ProbeSize<Traced>() == sizeof(int));
+
+TEST_CASE("Tracepoints") {
+    // Hit every kind of probe, so that all of them get instantiated
+    {
+        auto made = MakeShared<Traced>();
+        WeakPtr<Traced> weak = made;
+        made.Reset();
+        REQUIRE(!weak.Lock());
+
+        SharedPtr<Traced> adopted(new Traced);
+        auto copy = adopted;
+
+        UniquePtr<Traced> unique(new Traced);
+        UniquePtr<Traced[]> array(new Traced[2]);
+    }
+
+    auto probes = ProbesInBinary();
+    for (auto name : {"make_shared", "block_new", "object_delete", "block_free", "lock_fail",
+                      "unique_delete"}) {
+        INFO(name);
+        REQUIRE(probes.count(name) == 1);
+    }
+}
@@ -1,8 +1,10 @@
 #include "shared.h"
 #include "weak.h"
+#include "unique.h"
 
 #include <catch.hpp>
 #include <cassert>
+#include <cstdio>
 #include <type_traits>
 
 template <class T>
@@ -235,3 +237,247 @@ TEST_CASE("WeakFromThis") {
     REQUIRE(!weak.Expired());
     REQUIRE(weak.Lock().Get() == ptr);
 }
+
+struct Compact : EnableCompactSharedFromThis<Compact> {
+    int value = 0;
+};
+
+struct alignas(64) OverAligned : EnableCompactSharedFromThis<OverAligned> {
+    int value = 0;
+};
+
+struct Head {
+    double payload = 0;
+};
+
+struct Tailed : Head, EnableCompactSharedFromThis<Tailed> {
+    int value = 0;
+};
+
+TEST_CASE("Compact SharedFromThis") {
+    static_assert(sizeof(Compact) == sizeof(int));
+    static_assert(noexcept(std::declval<Compact&>().WeakFromThis()));
+
+    SECTION("MakeShared") {
+        auto sp = MakeShared<Compact>();
+        REQUIRE(sp.UseCount() == 1);
+        {
+            auto other = sp->SharedFromThis();
+            REQUIRE(other == sp);
+            REQUIRE(sp.UseCount() == 2);
+        }
+        const Compact* cptr = sp.Get();
+        SharedPtr<const Compact> csp = cptr->SharedFromThis();
+        REQUIRE(csp.Get() == cptr);
+
+        auto weak = sp->WeakFromThis();
+        csp.Reset();
+        sp.Reset();
+        REQUIRE(weak.Expired());
+    }
+
+    SECTION("MakeUniqueShareable") {
+        auto unique = MakeUniqueShareable<Compact>();
+        SharedPtr<Compact> sp(std::move(unique));
+        auto other = sp->SharedFromThis();
+        REQUIRE(sp.UseCount() == 2);
+        WeakPtr<Compact> weak = sp->WeakFromThis();
+        REQUIRE(weak.Lock() == sp);
+        other.Reset();
+        sp.Reset();
+        REQUIRE(weak.Expired());
+    }
+
+    SECTION("Not the first base") {
+        auto sp = MakeShared<Tailed>();
+        REQUIRE(sp->SharedFromThis() == sp);
+        REQUIRE(sp.UseCount() == 1);
+    }
+
+    SECTION("Over-aligned") {
+        auto sp = MakeShared<OverAligned>();
+        REQUIRE(sp->SharedFromThis() == sp);
+        REQUIRE(sp.UseCount() == 1);
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Everything below runs during compilation
+
+struct ListNode {
+    int value;
+    UniquePtr<ListNode> next;
+};
+
+constexpr int ListSum(int n) {
+    UniquePtr<ListNode> head;
+    for (int i = 1; i <= n; ++i) {
+        head = UniquePtr<ListNode>(new ListNode{i, std::move(head)});
+    }
+    int sum = 0;
+    for (auto node = head.Get(); node; node = node->next.Get()) {
+        sum += node->value;
+    }
+    return sum;
+}
+
+constexpr int SquaresSum(int n) {
+    UniquePtr<int[]> squares(new int[n]);
+    for (int i = 0; i < n; ++i) {
+        squares[i] = i * i;
+    }
+    UniquePtr<int[]> other;
+    other.Swap(squares);
+    int sum = 0;
+    for (int i = 0; i < n; ++i) {
+        sum += other[i];
+    }
+    other.Reset(new int[1]);
+    return squares ? -1 : sum;
+}
+
+struct CountingDeleter {
+    int* calls = nullptr;
+
+    constexpr void operator()(void*) const {
+        ++*calls;
+    }
+};
+
+constexpr int VoidDeleterCalls() {
+    int calls = 0;
+    int x = 0;
+    int y = 0;
+    {
+        UniquePtr<void, CountingDeleter> a(&x, CountingDeleter{&calls});
+        UniquePtr<void, CountingDeleter> b = std::move(a);
+        b.Reset(&y);
+        a = std::move(b);
+    }
+    return calls;
+}
+
+struct EmptyFirst {};
+struct EmptySecond {};
+
+constexpr bool PairsWork() {
+    CompressedPair<int, int> both(1, 2);
+    CompressedPair<int, EmptySecond> second(3, EmptySecond{});
+    CompressedPair<EmptyFirst, int> first(EmptyFirst{}, 4);
+    CompressedPair<EmptyFirst, EmptySecond> none;
+    both.GetFirst() += second.GetFirst();
+    return both.GetFirst() == 4 && both.GetSecond() == 2 && first.GetSecond() == 4 &&
+           sizeof(none) == 1 && sizeof(second) == sizeof(int);
+}
+
+static_assert(ListSum(100) == 5050);
+static_assert(SquaresSum(10) == 285);
+static_assert(VoidDeleterCalls() == 2);
+static_assert(PairsWork());
+
+TEST_CASE("Constexpr UniquePtr also works at runtime") {
+    int n = 100;
+    REQUIRE(ListSum(n) == 5050);
+    REQUIRE(SquaresSum(n / 10) == 285);
+    REQUIRE(VoidDeleterCalls() == 2);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+struct Handle {
+    int fd = -1;
+};
+
+int closed_handles = 0;
+
+void CloseHandle(Handle* handle) {
+    ++closed_handles;
+    delete handle;
+}
+
+static_assert(sizeof(UniquePtr<FILE, FnDeleter<fclose>>) == sizeof(FILE*));
+static_assert(sizeof(UniquePtr<Handle, FnDeleter<CloseHandle>>) == sizeof(Handle*));
+static_assert(sizeof(UniquePtr<void, FnDeleter<free>>) == sizeof(void*));
+static_assert(sizeof(UniquePtr<Handle, void (*)(Handle*)>) == 2 * sizeof(Handle*));
+
+TEST_CASE("Function deleters") {
+    closed_handles = 0;
+    {
+        UniquePtr<Handle, FnDeleter<CloseHandle>> a(new Handle{3});
+        UniquePtr<Handle, FnDeleter<CloseHandle>> b(new Handle{4});
+        REQUIRE(a->fd == 3);
+        a = std::move(b);
+        REQUIRE(closed_handles == 1);
+        REQUIRE(a->fd == 4);
+        REQUIRE(!b);
+        b.Reset(new Handle{5});
+    }
+    REQUIRE(closed_handles == 3);
+
+    UniquePtr<void, FnDeleter<free>> raw(malloc(16));
+    REQUIRE(raw);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+struct Animal {
+    virtual ~Animal() = default;
+};
+
+struct Cat : Animal {
+    int lives = 9;
+};
+
+struct Dog : Animal {};
+
+struct AnimalDeleter {
+    int* calls = nullptr;
+
+    void operator()(Animal* animal) const {
+        ++*calls;
+        delete animal;
+    }
+};
+
+TEST_CASE("UniquePtr casts") {
+    SECTION("Default deleter") {
+        UniquePtr<Animal> animal(new Cat);
+        auto dog = DynamicPointerCast<Dog>(std::move(animal));
+        REQUIRE(!dog);
+        REQUIRE(animal);
+
+        UniquePtr<Cat> cat = DynamicPointerCast<Cat>(std::move(animal));
+        REQUIRE(!animal);
+        REQUIRE(cat->lives == 9);
+
+        UniquePtr<const Animal> const_animal = StaticPointerCast<const Animal>(std::move(cat));
+        auto mutable_animal = ConstPointerCast<Animal>(std::move(const_animal));
+        static_assert(std::is_same_v<decltype(mutable_animal),
+                                     UniquePtr<Animal, DefaultDeleter<const Animal>>>);
+        auto back = StaticPointerCast<Cat>(std::move(mutable_animal));
+        REQUIRE(back->lives == 9);
+    }
+
+    SECTION("Keeps the deleter") {
+        int calls = 0;
+        {
+            UniquePtr<Animal, AnimalDeleter> animal(new Cat, AnimalDeleter{&calls});
+            auto cat = StaticPointerCast<Cat>(std::move(animal));
+            static_assert(std::is_same_v<decltype(cat), UniquePtr<Cat, AnimalDeleter>>);
+            REQUIRE(!animal);
+            REQUIRE(cat.GetDeleter().calls == &calls);
+            REQUIRE(cat->lives == 9);
+        }
+        REQUIRE(calls == 1);
+    }
+
+    SECTION("Arrays") {
+        UniquePtr<const int[]> numbers(new int[3]{1, 2, 3});
+        auto mutable_numbers = ConstPointerCast<int[]>(std::move(numbers));
+        mutable_numbers[0] = 4;
+        auto back = StaticPointerCast<const int[]>(std::move(mutable_numbers));
+        static_assert(std::is_same_v<decltype(back), UniquePtr<const int[]>>);
+        REQUIRE(back[0] == 4);
+        REQUIRE(back[2] == 3);
+    }
+}
@@ -5,6 +5,11 @@
 
 #include <catch.hpp>
 
+#include <atomic>
+#include <iterator>
+#include <thread>
+#include <vector>
+
 ////////////////////////////////////////////////////////////////////////////////////////////////////
 
 TEST_CASE("Empty weak") {
@@ -163,3 +168,82 @@ TEST_CASE("Lifetimes") {
         delete wp;
     }
 }
+
+TEST_CASE("Bulk weak sharing") {
+    auto sp = MakeShared<int>(42);
+    std::vector<WeakPtr<int>> observers;
+    sp.ShareWeakN(100, std::back_inserter(observers));
+    REQUIRE(observers.size() == 100);
+    REQUIRE(*observers.front().Lock() == 42);
+
+    WeakPtr<int> weak(sp);
+    weak.ShareN(10, std::back_inserter(observers));
+    REQUIRE(observers.size() == 110);
+
+    sp.Reset();
+    REQUIRE(observers.back().Expired());
+    observers.clear();
+}
+
+TEST_CASE("Expiry callbacks") {
+    int fired = 0;
+    auto count = [&fired] { ++fired; };
+
+    SECTION("Fired once on the last release") {
+        auto sp = MakeShared<int>(42);
+        WeakPtr<int> wp = sp;
+        wp.OnExpire(count);
+        wp.OnExpire([&fired, wp] {
+            REQUIRE(wp.Expired());
+            ++fired;
+        });
+        auto copy = sp;
+        sp.Reset();
+        REQUIRE(fired == 0);
+        copy.Reset();
+        REQUIRE(fired == 2);
+        wp.Reset();
+        REQUIRE(fired == 2);
+    }
+
+    SECTION("Sole owner") {
+        SharedPtr<int> sp(new int(42));
+        WeakPtr<int>(sp).OnExpire(count);
+        sp.Reset();
+        REQUIRE(fired == 1);
+    }
+
+    SECTION("Already expired") {
+        WeakPtr<int> wp = MakeShared<int>(42);
+        wp.OnExpire(count);
+        REQUIRE(fired == 1);
+        WeakPtr<int>().OnExpire(count);
+        REQUIRE(fired == 2);
+    }
+}
+
+#ifdef SMART_POINTERS_THREADED
+
+TEST_CASE("Expiry callbacks race releases") {
+    for (int iteration = 0; iteration < 1000; ++iteration) {
+        std::atomic<int> fired = 0;
+        auto sp = MakeShared<int>(iteration);
+        WeakPtr<int> wp = sp;
+        std::vector<SharedPtr<int>> owners(4, sp);
+        sp.Reset();
+
+        std::vector<std::thread> threads;
+        for (auto& owner : owners) {
+            threads.emplace_back([&owner] { owner.Reset(); });
+        }
+        for (int i = 0; i < 4; ++i) {
+            wp.OnExpire([&fired] { ++fired; });
+        }
+        for (auto& thread : threads) {
+            thread.join();
+        }
+        REQUIRE(fired == 4);
+    }
+}
+
+#endif
@@ -0,0 +1,138 @@
+#include "weak_key_map.h"
+
+#include <catch.hpp>
+#include <string>
+#include <vector>
+
+struct Node {
+    int id = 0;
+};
+
+struct Pair {
+    int first = 0;
+    int second = 0;
+};
+
+template <typename Ptr>
+concept NodeKey = requires(WeakKeyMap<Node, int>& map, const Ptr& key) { map.Find(key); };
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+static_assert(NodeKey<SharedPtr<Node>>);
+static_assert(NodeKey<SharedPtr<const Node>>);
+static_assert(NodeKey<WeakPtr<Node>>);
+static_assert(!NodeKey<SharedPtr<int>>);
+static_assert(!NodeKey<Node*>);
+
+TEST_CASE("Owner comparison") {
+    auto pair = MakeShared<Pair>();
+    SharedPtr<int> first(pair, &pair->first);
+    SharedPtr<int> second(pair, &pair->second);
+    WeakPtr<Pair> weak = pair;
+    auto other = MakeShared<Pair>();
+
+    REQUIRE(first.OwnerEqual(second));
+    REQUIRE(first.OwnerEqual(weak));
+    REQUIRE(weak.OwnerEqual(second));
+    REQUIRE(first.OwnerHash() == weak.OwnerHash());
+    REQUIRE(!first.OwnerEqual(other));
+
+    REQUIRE(!first.OwnerBefore(second));
+    REQUIRE(!second.OwnerBefore(first));
+    REQUIRE(first.OwnerBefore(other) != other.OwnerBefore(weak));
+
+    pair.Reset();
+    first.Reset();
+    second.Reset();
+    REQUIRE(weak.Expired());
+    REQUIRE(weak.OwnerEqual(weak));
+    REQUIRE(!weak.OwnerEqual(SharedPtr<Pair>()));
+}
+
+TEST_CASE("WeakKeyMap") {
+    SECTION("Lookups") {
+        WeakKeyMap<Node, std::string> map;
+        auto a = MakeShared<Node>();
+        auto b = MakeShared<Node>();
+        REQUIRE(map.Find(a) == nullptr);
+        map.Emplace(a, "a");
+        map.Emplace(WeakPtr<Node>(b), "b");
+        REQUIRE(map.Emplace(a, "other") == "a");
+        REQUIRE(map.Size() == 2);
+        REQUIRE(*map.Find(a) == "a");
+        REQUIRE(*map.Find(WeakPtr<Node>(b)) == "b");
+
+        SharedPtr<const Node> view = a;
+        REQUIRE(*map.Find(view) == "a");
+
+        REQUIRE(map.Erase(a));
+        REQUIRE(!map.Erase(a));
+        REQUIRE(map.Find(a) == nullptr);
+        REQUIRE(map.Size() == 1);
+
+        REQUIRE_THROWS_AS(map.Emplace(SharedPtr<Node>(), "none"), BadWeakPtr);
+        REQUIRE(map.Find(WeakPtr<Node>()) == nullptr);
+    }
+
+    SECTION("Expired keys") {
+        WeakKeyMap<Node, int> map;
+        auto a = MakeShared<Node>();
+        WeakPtr<Node> weak = a;
+        map.Emplace(a, 1);
+        a.Reset();
+        REQUIRE(map.Size() == 1);
+        REQUIRE(map.Find(weak) == nullptr);
+        REQUIRE(map.Size() == 0);
+
+        // The block stays while the map has it, so a new object can not take the address
+        auto b = MakeShared<Node>();
+        map.Emplace(b, 2);
+        b.Reset();
+        weak.Reset();
+        REQUIRE(map.Purge() == 1);
+        REQUIRE(map.Empty());
+    }
+
+    SECTION("Many keys") {
+        WeakKeyMap<Node, int> map;
+        std::vector<SharedPtr<Node>> keys;
+        for (int i = 0; i < 1000; ++i) {
+            keys.push_back(MakeShared<Node>(Node{i}));
+            map.Emplace(keys.back(), i);
+        }
+        REQUIRE(map.Size() == 1000);
+        for (int i = 0; i < 1000; ++i) {
+            REQUIRE(*map.Find(keys[i]) == i);
+        }
+
+        // Every other key dies, lookups and inserts clean up after them
+        for (int i = 0; i < 1000; i += 2) {
+            keys[i].Reset();
+        }
+        int seen = 0;
+        map.ForEach([&](int value) {
+            REQUIRE(value % 2 == 1);
+            ++seen;
+        });
+        REQUIRE(seen == 500);
+        for (int i = 1; i < 1000; i += 2) {
+            REQUIRE(*map.Find(keys[i]) == i);
+            if (i % 4 == 1) {
+                REQUIRE(map.Erase(keys[i]));
+                REQUIRE(!map.Erase(keys[i]));
+            } else {
+                keys[i].Reset();
+            }
+        }
+        map.Purge();
+        REQUIRE(map.Size() == 0);
+
+        // Rehash throws away what is dead instead of growing
+        auto capacity = map.Capacity();
+        for (int i = 0; i < 10000; ++i) {
+            auto key = MakeShared<Node>();
+            map.Emplace(key, i);
+        }
+        REQUIRE(map.Capacity() <= capacity);
+    }
+}
@@ -0,0 +1,151 @@
+#include "weak_value_cache.h"
+
+#include <catch.hpp>
+
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+TEST_CASE("Cache lookups") {
+    WeakValueCache<int, std::string> cache;
+    int calls = 0;
+    auto factory = [&calls] {
+        ++calls;
+        return MakeShared<std::string>("aba");
+    };
+
+    SECTION("Created once while alive") {
+        auto a = cache.GetOrCreate(1, factory);
+        auto b = cache.GetOrCreate(1, factory);
+        REQUIRE(calls == 1);
+        REQUIRE(a == b);
+        REQUIRE(cache.Get(1) == a);
+        REQUIRE(!cache.Get(2));
+    }
+
+    SECTION("Values die naturally") {
+        cache.GetOrCreate(1, factory);
+        REQUIRE(!cache.Get(1));
+        cache.GetOrCreate(1, factory);
+        REQUIRE(calls == 2);
+    }
+
+    SECTION("Erase") {
+        auto a = cache.GetOrCreate(1, factory);
+        cache.Erase(1);
+        REQUIRE(!cache.Get(1));
+        REQUIRE(*a == "aba");
+    }
+
+    SECTION("Faulty factory") {
+        REQUIRE_THROWS(cache.GetOrCreate(1, []() -> SharedPtr<std::string> { throw 42; }));
+        REQUIRE(cache.Size() == 0);
+        REQUIRE(*cache.GetOrCreate(1, factory) == "aba");
+    }
+}
+
+TEST_CASE("Cache purges expired entries") {
+    WeakValueCache<int, int> cache(1);
+    for (int i = 0; i < 1000; ++i) {
+        cache.GetOrCreate(i, [i] { return MakeShared<int>(i); });
+    }
+    // Lazy purging keeps at most about twice the live entries
+    REQUIRE(cache.Size() < 32);
+
+    auto alive = cache.GetOrCreate(-1, [] { return MakeShared<int>(-1); });
+    cache.Purge();
+    REQUIRE(cache.Size() == 1);
+}
+
+TEST_CASE("Cache strong tail") {
+    WeakValueCache<int, int> cache(1, 2);
+    int calls = 0;
+    auto factory = [&calls] {
+        ++calls;
+        return MakeShared<int>(calls);
+    };
+
+    cache.GetOrCreate(1, factory);
+    cache.GetOrCreate(2, factory);
+    REQUIRE(cache.Get(1));
+    REQUIRE(cache.Get(2));
+
+    // 1 was used last, so 2 falls off the tail
+    cache.Get(1);
+    cache.GetOrCreate(3, factory);
+    REQUIRE(cache.Get(1));
+    REQUIRE(!cache.Get(2));
+    REQUIRE(calls == 3);
+
+    cache.Erase(1);
+    REQUIRE(!cache.Get(1));
+}
+
+TEST_CASE("Cache does not keep empty values") {
+    WeakValueCache<int, int> cache(1, 2);
+    auto empty = [] { return SharedPtr<int>(); };
+    REQUIRE(!cache.GetOrCreate(1, empty));
+    REQUIRE(!cache.GetOrCreate(1, empty));
+    REQUIRE(cache.Size() == 0);
+
+    // Enough inserts to both purge the shard and evict from the strong tail
+    std::vector<SharedPtr<int>> alive;
+    for (int i = 2; i < 100; ++i) {
+        alive.push_back(cache.GetOrCreate(i, [i] { return MakeShared<int>(i); }));
+    }
+    REQUIRE(*cache.GetOrCreate(1, [] { return MakeShared<int>(1); }) == 1);
+    REQUIRE(*cache.Get(99) == 99);
+}
+
+TEST_CASE("Cache clear") {
+    WeakValueCache<int, int> cache(4, 8);
+    auto kept = cache.GetOrCreate(1, [] { return MakeShared<int>(1); });
+    WeakPtr<int> dropped = cache.GetOrCreate(2, [] { return MakeShared<int>(2); });
+    REQUIRE(!dropped.Expired());
+
+    cache.Clear();
+    REQUIRE(cache.Size() == 0);
+    REQUIRE(!cache.Get(1));
+    REQUIRE(dropped.Expired());
+    REQUIRE(*kept == 1);
+}
+
+#ifdef SMART_POINTERS_THREADED
+
+TEST_CASE("Concurrent misses create once") {
+    WeakValueCache<int, int> cache(4);
+    std::atomic<int> calls = 0;
+    std::atomic<int> mismatches = 0;
+    std::atomic<int> done = 0;
+
+    std::vector<std::thread> threads;
+    for (int i = 0; i < 8; ++i) {
+        threads.emplace_back([&] {
+            std::vector<SharedPtr<int>> values;
+            for (int key = 0; key < 64; ++key) {
+                values.push_back(cache.GetOrCreate(key, [&calls, key] {
+                    ++calls;
+                    return MakeShared<int>(key);
+                }));
+                if (*values.back() != key) {
+                    ++mismatches;
+                }
+            }
+            // Everybody holds on to the values until all threads are done with them
+            ++done;
+            while (done < 8) {
+                std::this_thread::yield();
+            }
+        });
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    REQUIRE(calls == 64);
+    REQUIRE(mismatches == 0);
+}
+
+#endif
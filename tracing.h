@@ -0,0 +1,85 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+#include <type_traits>
+
+// Static tracepoints (USDT) on ownership transitions, for `perf` and `bpftrace` on production
+// binaries. Define `SMART_POINTERS_USDT` to compile them in; it takes `<sys/sdt.h>` (systemtap-sdt
+// headers). A probe that nobody is attached to is a single `nop`. Without the macro there is
+// nothing at all.
+//
+// Provider `smart_pointers`, every probe has the same three arguments:
+//   arg0  hash of the type name, see `kTypeNameHash`
+//   arg1  size of the object (0 for `void` and incomplete types)
+//   arg2  address of the object, or of the control block for the `block_*` probes
+//
+// Probes:
+//   make_shared    `MakeShared` has created an object
+//   block_new      a control block is allocated
+//   object_delete  a control block destroys its object (or a lazy `SharedPtr` does)
+//   block_free     a control block is freed
+//   lock_fail      `WeakPtr::Lock` on an expired object
+//   unique_delete  `UniquePtr` calls its deleter
+//
+// Example scripts are in `bpftrace/`.
+
+// The name of `T` as the compiler spells it, e.g. "std::vector<int>"
+template <typename T>
+constexpr std::string_view TypeName() {
+    // "... TypeName() [with T = Foo; std::string_view = ...]" on GCC, "... [T = Foo]" on Clang
+    std::string_view name = __PRETTY_FUNCTION__;
+    auto start = name.find("T = ") + 4;
+    auto end = name.find(';', start);
+    if (end == std::string_view::npos) {
+        end = name.rfind(']');
+    }
+    return name.substr(start, end - start);
+}
+
+// FNV-1a of `TypeName<T>()`: a number for scripts to group by, computed at compile time
+template <typename T>
+inline constexpr uint64_t kTypeNameHash = [] {
+    uint64_t hash = 0xcbf29ce484222325ull;
+    for (char c : TypeName<T>()) {
+        hash = (hash ^ static_cast<unsigned char>(c)) * 0x100000001b3ull;
+    }
+    return hash;
+}();
+
+template <typename T>
+constexpr size_t ProbeSize() {
+    if constexpr (std::is_void_v<T>) {
+        return 0;
+    } else if constexpr (requires { sizeof(T); }) {
+        return sizeof(T);
+    } else {
+        return 0;
+    }
+}
+
+#ifdef SMART_POINTERS_USDT
+
+#if !__has_include(<sys/sdt.h>)
+#error "SMART_POINTERS_USDT needs <sys/sdt.h>, install the systemtap-sdt headers"
+#endif
+
+#include <sys/sdt.h>
+
+// Skipped in constant evaluation, `UniquePtr` is usable there
+#define SMART_POINTERS_PROBE(name, T, address)                                                    \
+    do {                                                                                           \
+        if (!std::is_constant_evaluated()) {                                                       \
+            STAP_PROBE3(smart_pointers, name, kTypeNameHash<T>, ProbeSize<T>(),                    \
+                        static_cast<const volatile void*>(address));                               \
+        }                                                                                          \
+    } while (false)
+
+#else
+
+#define SMART_POINTERS_PROBE(name, T, address) \
+    do {                                       \
+    } while (false)
+
+#endif
@@ -1,5 +1,6 @@
 #pragma once
 
+#include "allocation.h"
 #include "compressed_pair.h"
 
 #include <cstddef>  // std::nullptr_t
@@ -7,9 +8,12 @@
 #include <type_traits>
 #include <stdlib.h>
 
+template <typename T, bool Shared = false>
+class Borrowed;
+
 template <typename T>
 struct DefaultDeleter {
-    DefaultDeleter() = default;
+    constexpr DefaultDeleter() = default;
 
     template <typename U>
     constexpr DefaultDeleter(DefaultDeleter<U>&&) {
@@ -22,14 +26,14 @@ struct DefaultDeleter {
         return *this;
     };
 
-    void operator()(T* ptr) const {
+    constexpr void operator()(T* ptr) const {
         delete ptr;
     }
 };
 
 template <typename T>
 struct DefaultDeleter<T[]> {
-    DefaultDeleter() = default;
+    constexpr DefaultDeleter() = default;
 
     template <typename U>
     constexpr DefaultDeleter(DefaultDeleter<U[]>&&) {
@@ -42,7 +46,7 @@ struct DefaultDeleter<T[]> {
         return *this;
     };
 
-    void operator()(T* ptr) const {
+    constexpr void operator()(T* ptr) const {
         delete[] ptr;
     }
 };
@@ -54,6 +58,26 @@ struct DefaultDeleter<void> {
     }
 };
 
+// Calls `Fn` on the pointer, e.g. `UniquePtr<FILE, FnDeleter<fclose>>`. Unlike a function pointer
+// it takes no space in `UniquePtr` and the call can be inlined.
+template <auto Fn>
+struct FnDeleter {
+    template <typename T>
+    constexpr void operator()(T* ptr) const {
+        Fn(ptr);
+    }
+};
+
+// The deleter for a converted `UniquePtr`: the old one, if it converts, or a new one otherwise
+template <typename Deleter, typename Other>
+constexpr Deleter ConvertDeleter(Other& other) {
+    if constexpr (std::is_constructible_v<Deleter, Other&&>) {
+        return Deleter(std::move(other));
+    } else {
+        return Deleter();
+    }
+}
+
 // Primary template
 template <typename T, typename Deleter = DefaultDeleter<T>>
 class UniquePtr {
@@ -61,20 +85,22 @@ public:
     ////////////////////////////////////////////////////////////////////////////////////////////////
     // Constructors
 
-    explicit UniquePtr(T* ptr = nullptr) : data_(ptr, Deleter()){};
-    UniquePtr(T* ptr, Deleter deleter) : data_(ptr, std::move(deleter)){};
+    constexpr explicit UniquePtr(T* ptr = nullptr) : data_(ptr, Deleter()){};
+    constexpr UniquePtr(T* ptr, Deleter deleter) : data_(ptr, std::move(deleter)){};
 
-    UniquePtr(UniquePtr&& other) noexcept : data_(other.Release(), std::move(other.GetDeleter())) {
+    constexpr UniquePtr(UniquePtr&& other) noexcept
+        : data_(other.Release(), std::move(other.GetDeleter())) {
     }
 
     template <typename TT, typename DD>
-    UniquePtr(UniquePtr<TT, DD>&& other) noexcept : data_(other.Release(), Deleter()) {
+    constexpr UniquePtr(UniquePtr<TT, DD>&& other) noexcept
+        : data_(other.Release(), ConvertDeleter<Deleter>(other.GetDeleter())) {
     }
 
     ////////////////////////////////////////////////////////////////////////////////////////////////
     // `operator=`-s
 
-    UniquePtr& operator=(UniquePtr&& other) noexcept {
+    constexpr UniquePtr& operator=(UniquePtr&& other) noexcept {
         if (this == &other) {
             return *this;
         }
@@ -85,9 +111,9 @@ public:
         return *this;
     }
 
-    UniquePtr& operator=(std::nullptr_t) {
+    constexpr UniquePtr& operator=(std::nullptr_t) {
         if (Get()) {
-            GetDeleter()(Release());
+            CallDeleter(Release());
         }
         return *this;
     }
@@ -95,66 +121,74 @@ public:
     ////////////////////////////////////////////////////////////////////////////////////////////////
     // Destructor
 
-    ~UniquePtr() {
+    constexpr ~UniquePtr() {
         if (Get()) {
-            GetDeleter()(Release());
+            CallDeleter(Release());
         }
     }
 
     ////////////////////////////////////////////////////////////////////////////////////////////////
     // Modifiers
 
-    T* Release() {
+    constexpr T* Release() {
         auto res = Get();
         data_.GetFirst() = nullptr;
         return res;
     }
 
-    void Reset(T* ptr = nullptr) {
+    constexpr void Reset(T* ptr = nullptr) {
         auto old_ptr = Get();
         data_.GetFirst() = ptr;
 
         if (old_ptr) {
-            GetDeleter()(old_ptr);
+            CallDeleter(old_ptr);
         }
     }
 
-    void Swap(UniquePtr& other) {
+    constexpr void Swap(UniquePtr& other) {
         std::swap(data_, other.data_);
     }
 
     ////////////////////////////////////////////////////////////////////////////////////////////////
     // Observers
 
-    T* Get() const {
+    constexpr T* Get() const {
         return data_.GetFirst();
     }
 
-    Deleter& GetDeleter() {
+    constexpr Deleter& GetDeleter() {
         return data_.GetSecond();
     }
 
-    const Deleter& GetDeleter() const {
+    constexpr const Deleter& GetDeleter() const {
         return data_.GetSecond();
     }
 
-    explicit operator bool() const {
+    constexpr explicit operator bool() const {
         return (Get() != nullptr);
     }
 
     ////////////////////////////////////////////////////////////////////////////////////////////////
     // Single-object dereference operators
 
-    T& operator*() const {
+    constexpr T& operator*() const {
         return *Get();
     }
 
-    T* operator->() const {
+    constexpr T* operator->() const {
         return Get();
     }
 
 private:
+    constexpr void CallDeleter(T* ptr) {
+        SMART_POINTERS_PROBE(unique_delete, T, ptr);
+        GetDeleter()(ptr);
+    }
+
     CompressedPair<T*, Deleter> data_;
+
+    template <typename Y, bool Shared>
+    friend class Borrowed;
 };
 
 //// Specialization for arrays
@@ -164,20 +198,22 @@ public:
     ////////////////////////////////////////////////////////////////////////////////////////////////
     // Constructors
 
-    explicit UniquePtr(T* ptr = nullptr) : data_(ptr, Deleter()){};
-    UniquePtr(T* ptr, Deleter deleter) : data_(ptr, std::move(deleter)){};
+    constexpr explicit UniquePtr(T* ptr = nullptr) : data_(ptr, Deleter()){};
+    constexpr UniquePtr(T* ptr, Deleter deleter) : data_(ptr, std::move(deleter)){};
 
-    UniquePtr(UniquePtr&& other) noexcept : data_(other.Release(), std::move(other.GetDeleter())) {
+    constexpr UniquePtr(UniquePtr&& other) noexcept
+        : data_(other.Release(), std::move(other.GetDeleter())) {
     }
 
     template <typename TT, typename DD>
-    UniquePtr(UniquePtr<TT, DD>&& other) noexcept : data_(other.Release(), Deleter()) {
+    constexpr UniquePtr(UniquePtr<TT, DD>&& other) noexcept
+        : data_(other.Release(), ConvertDeleter<Deleter>(other.GetDeleter())) {
     }
 
     ////////////////////////////////////////////////////////////////////////////////////////////////
     // `operator=`-s
 
-    UniquePtr& operator=(UniquePtr&& other) noexcept {
+    constexpr UniquePtr& operator=(UniquePtr&& other) noexcept {
         if (this == &other) {
             return *this;
         }
@@ -188,9 +224,9 @@ public:
         return *this;
     }
 
-    UniquePtr& operator=(std::nullptr_t) {
+    constexpr UniquePtr& operator=(std::nullptr_t) {
         if (Get()) {
-            GetDeleter()(Release());
+            CallDeleter(Release());
         }
         return *this;
     }
@@ -198,58 +234,63 @@ public:
     ////////////////////////////////////////////////////////////////////////////////////////////////
     // Destructor
 
-    ~UniquePtr() {
+    constexpr ~UniquePtr() {
         if (Get()) {
-            GetDeleter()(Release());
+            CallDeleter(Release());
         }
     }
 
     ////////////////////////////////////////////////////////////////////////////////////////////////
     // Modifiers
 
-    T* Release() {
+    constexpr T* Release() {
         auto res = Get();
         data_.GetFirst() = nullptr;
         return res;
     }
 
-    void Reset(T* ptr = nullptr) {
+    constexpr void Reset(T* ptr = nullptr) {
         auto old_ptr = Get();
         data_.GetFirst() = ptr;
 
         if (old_ptr) {
-            GetDeleter()(old_ptr);
+            CallDeleter(old_ptr);
         }
     }
 
-    void Swap(UniquePtr& other) {
+    constexpr void Swap(UniquePtr& other) {
         std::swap(data_, other.data_);
     }
 
     ////////////////////////////////////////////////////////////////////////////////////////////////
     // Observers
 
-    T* Get() const {
+    constexpr T* Get() const {
         return data_.GetFirst();
     }
 
-    Deleter& GetDeleter() {
+    constexpr Deleter& GetDeleter() {
         return data_.GetSecond();
     }
 
-    const Deleter& GetDeleter() const {
+    constexpr const Deleter& GetDeleter() const {
         return data_.GetSecond();
     }
 
-    explicit operator bool() const {
+    constexpr explicit operator bool() const {
         return (Get() != nullptr);
     }
 
-    T& operator[](size_t index) {
+    constexpr T& operator[](size_t index) const {
         return *(Get() + index);
     }
 
 private:
+    constexpr void CallDeleter(T* ptr) {
+        SMART_POINTERS_PROBE(unique_delete, T, ptr);
+        GetDeleter()(ptr);
+    }
+
     CompressedPair<T*, Deleter> data_;
 };
 
@@ -260,20 +301,22 @@ public:
     ////////////////////////////////////////////////////////////////////////////////////////////////
     // Constructors
 
-    explicit UniquePtr(void* ptr = nullptr) : data_(ptr, Deleter()){};
-    UniquePtr(void* ptr, Deleter deleter) : data_(ptr, std::move(deleter)){};
+    constexpr explicit UniquePtr(void* ptr = nullptr) : data_(ptr, Deleter()){};
+    constexpr UniquePtr(void* ptr, Deleter deleter) : data_(ptr, std::move(deleter)){};
 
-    UniquePtr(UniquePtr&& other) noexcept : data_(other.Release(), std::move(other.GetDeleter())) {
+    constexpr UniquePtr(UniquePtr&& other) noexcept
+        : data_(other.Release(), std::move(other.GetDeleter())) {
     }
 
     template <typename TT, typename DD>
-    UniquePtr(UniquePtr<TT, DD>&& other) noexcept : data_(other.Release(), Deleter()) {
+    constexpr UniquePtr(UniquePtr<TT, DD>&& other) noexcept
+        : data_(other.Release(), ConvertDeleter<Deleter>(other.GetDeleter())) {
     }
 
     ////////////////////////////////////////////////////////////////////////////////////////////////
     // `operator=`-s
 
-    UniquePtr& operator=(UniquePtr&& other) noexcept {
+    constexpr UniquePtr& operator=(UniquePtr&& other) noexcept {
         if (this == &other) {
             return *this;
         }
@@ -284,9 +327,9 @@ public:
         return *this;
     }
 
-    UniquePtr& operator=(std::nullptr_t) {
+    constexpr UniquePtr& operator=(std::nullptr_t) {
         if (Get()) {
-            GetDeleter()(Release());
+            CallDeleter(Release());
         }
         return *this;
     }
@@ -294,57 +337,130 @@ public:
     ////////////////////////////////////////////////////////////////////////////////////////////////
     // Destructor
 
-    ~UniquePtr() {
+    constexpr ~UniquePtr() {
         if (Get()) {
-            GetDeleter()(Release());
+            CallDeleter(Release());
         }
     }
 
     ////////////////////////////////////////////////////////////////////////////////////////////////
     // Modifiers
 
-    void* Release() {
+    constexpr void* Release() {
         auto res = Get();
         data_.GetFirst() = nullptr;
         return res;
     }
 
-    void Reset(void* ptr = nullptr) {
+    constexpr void Reset(void* ptr = nullptr) {
         auto old_ptr = Get();
         data_.GetFirst() = ptr;
 
         if (old_ptr) {
-            GetDeleter()(old_ptr);
+            CallDeleter(old_ptr);
         }
     }
 
-    void Swap(UniquePtr& other) {
+    constexpr void Swap(UniquePtr& other) {
         std::swap(data_, other.data_);
     }
 
     ////////////////////////////////////////////////////////////////////////////////////////////////
     // Observers
 
-    void* Get() const {
+    constexpr void* Get() const {
         return data_.GetFirst();
     }
 
-    Deleter& GetDeleter() {
+    constexpr Deleter& GetDeleter() {
         return data_.GetSecond();
     }
 
-    const Deleter& GetDeleter() const {
+    constexpr const Deleter& GetDeleter() const {
         return data_.GetSecond();
     }
 
-    explicit operator bool() const {
+    constexpr explicit operator bool() const {
         return (Get() != nullptr);
     }
 
-    void* operator->() const {
+    constexpr void* operator->() const {
         return Get();
     }
 
 private:
+    constexpr void CallDeleter(void* ptr) {
+        SMART_POINTERS_PROBE(unique_delete, void, ptr);
+        GetDeleter()(ptr);
+    }
+
     CompressedPair<void*, Deleter> data_;
 };
+
+template <typename T, typename... Args>
+UniquePtr<T> MakeUnique(Args&&... args) {
+    return UniquePtr<T>(new T(std::forward<Args>(args)...));
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Casts
+// The deleter moves over to the result, and has to accept the new pointer type. For static and
+// dynamic casts `DefaultDeleter` is swapped for `DefaultDeleter<T>`, the object is of that type
+// after all. `ConstPointerCast` keeps the deleter type as it is, so the object is still destroyed
+// as what it was made. There is no `ReinterpretPointerCast` for `UniquePtr`: nothing could destroy
+// the object through the new pointer. A failed `DynamicPointerCast` leaves `other` as it was.
+// Arrays cast to arrays only, the elements are cast and `delete[]` stays `delete[]`.
+
+template <typename Deleter, typename T>
+struct RebindDeleterTraits {
+    using Type = Deleter;
+};
+
+template <typename U, typename T>
+struct RebindDeleterTraits<DefaultDeleter<U>, T> {
+    using Type = DefaultDeleter<T>;
+};
+
+template <typename U, typename T>
+struct RebindDeleterTraits<DefaultDeleter<U[]>, T[]> {
+    using Type = DefaultDeleter<T[]>;
+};
+
+template <typename Deleter, typename T>
+using RebindDeleter = typename RebindDeleterTraits<Deleter, T>::Type;
+
+// Moves `other` into a `UniquePtr<T, Deleter>` to `ptr`, unless `ptr` is null
+template <typename T, typename Deleter, typename U, typename D>
+constexpr UniquePtr<T, Deleter> CastUnique(UniquePtr<U, D>& other, std::remove_extent_t<T>* ptr) {
+    static_assert(std::is_array_v<T> == std::is_array_v<U>,
+                  "an array must be cast to an array, and only to an array");
+    using Result = UniquePtr<T, Deleter>;
+    if (!ptr) {
+        return Result();
+    }
+    if constexpr (std::is_same_v<Deleter, D>) {
+        Result res(ptr, std::move(other.GetDeleter()));
+        other.Release();
+        return res;
+    } else {
+        other.Release();
+        return Result(ptr);
+    }
+}
+
+template <typename T, typename U, typename D>
+constexpr UniquePtr<T, RebindDeleter<D, T>> StaticPointerCast(UniquePtr<U, D>&& other) {
+    return CastUnique<T, RebindDeleter<D, T>>(other,
+                                              static_cast<std::remove_extent_t<T>*>(other.Get()));
+}
+
+template <typename T, typename U, typename D>
+constexpr UniquePtr<T, RebindDeleter<D, T>> DynamicPointerCast(UniquePtr<U, D>&& other) {
+    return CastUnique<T, RebindDeleter<D, T>>(other,
+                                              dynamic_cast<std::remove_extent_t<T>*>(other.Get()));
+}
+
+template <typename T, typename U, typename D>
+constexpr UniquePtr<T, D> ConstPointerCast(UniquePtr<U, D>&& other) {
+    return CastUnique<T, D>(other, const_cast<std::remove_extent_t<T>*>(other.Get()));
+}
@@ -2,6 +2,8 @@
 
 #include "sw_fwd.h"  // Forward declaration
 
+#include <functional>
+
 // https://en.cppreference.com/w/cpp/memory/weak_ptr
 template <typename T>
 class WeakPtr {
@@ -27,7 +29,7 @@ public:
     // Demote `SharedPtr`
     // #2 from https://en.cppreference.com/w/cpp/memory/weak_ptr/weak_ptr
     WeakPtr(const SharedPtr<T>& other)
-        : stored_ptr_(other.stored_ptr_), control_block_(other.control_block_) {
+        : stored_ptr_(other.stored_ptr_), control_block_(other.Block()) {
         if (operator bool()) {
             control_block_->WeakIncrement();
         }
@@ -35,7 +37,7 @@ public:
 
     template <typename Y>
     WeakPtr(const SharedPtr<Y>& other)
-        : stored_ptr_(other.stored_ptr_), control_block_(other.control_block_) {
+        : stored_ptr_(other.stored_ptr_), control_block_(other.Block()) {
         if (operator bool()) {
             control_block_->WeakIncrement();
         }
@@ -73,13 +75,10 @@ public:
 
     ~WeakPtr() {
         if (operator bool()) {
-            if (UseCount() == 0 && control_block_->GetWeakCount() == 1) {
-                control_block_->WeakDecrement();
+            if (control_block_->WeakDecrement() == 0) {
                 auto control_block_address = control_block_;
                 control_block_ = nullptr;
-                delete control_block_address;
-            } else {
-                control_block_->WeakDecrement();
+                control_block_address->BlockDelete();
             }
         }
     }
@@ -88,13 +87,8 @@ public:
     // Modifiers
 
     void Reset() {
-        if (operator bool()) {
-            if (UseCount() == 0 && control_block_->GetWeakCount() == 1) {
-                control_block_->WeakDecrement();
-                delete control_block_;
-            } else {
-                control_block_->WeakDecrement();
-            }
+        if (operator bool() && control_block_->WeakDecrement() == 0) {
+            control_block_->BlockDelete();
         }
         stored_ptr_ = nullptr;
         control_block_ = nullptr;
@@ -105,6 +99,38 @@ public:
         std::swap(control_block_, other.control_block_);
     }
 
+    ////////////////////////////////////////////////////////////////////////////////////////////////
+    // Bulk sharing
+    // Same as writing `n` copies to `out`, but the control block is updated only once. Throws
+    // `std::length_error` if `n` does not fit into the counter.
+
+    template <typename OutputIt>
+    OutputIt ShareN(size_t n, OutputIt out) const {
+        if (operator bool() && n > 0) {
+            control_block_->WeakIncrementBy(BulkCount(n));
+        }
+        size_t written = 0;
+        try {
+            for (; written < n; ++written) {
+                WeakPtr<T> copy;
+                copy.stored_ptr_ = stored_ptr_;
+                copy.control_block_ = control_block_;
+                *out = std::move(copy);
+                ++out;
+            }
+        } catch (...) {
+            // Give back the references nobody has got. The one that failed to be written is
+            // already taken care of by `copy`.
+            for (++written; written < n; ++written) {
+                WeakPtr<T> copy;
+                copy.stored_ptr_ = stored_ptr_;
+                copy.control_block_ = control_block_;
+            }
+            throw;
+        }
+        return out;
+    }
+
     ////////////////////////////////////////////////////////////////////////////////////////////////
     // Observers
 
@@ -127,7 +153,72 @@ public:
     }
 
     SharedPtr<T> Lock() const {
-        return Expired() ? SharedPtr<T>() : SharedPtr<T>(*this);
+        SharedPtr<T> res;
+        if (operator bool() && control_block_->TryIncrement()) {
+            res.stored_ptr_ = stored_ptr_;
+            res.control_block_ = control_block_;
+        } else if (operator bool()) {
+            SMART_POINTERS_PROBE(lock_fail, T, stored_ptr_);
+        }
+        return res;
+    }
+
+    ////////////////////////////////////////////////////////////////////////////////////////////////
+    // Owner-based comparison
+    // By control block instead of the stored pointer: aliases of one object are equal, and a
+    // `WeakPtr` keeps its place after the object has expired.
+
+    template <typename Y>
+    bool OwnerBefore(const SharedPtr<Y>& other) const {
+        return std::less<const void*>()(control_block_, other.OwnerKey());
+    }
+
+    template <typename Y>
+    bool OwnerBefore(const WeakPtr<Y>& other) const {
+        return std::less<ControlBlock*>()(control_block_, other.control_block_);
+    }
+
+    template <typename Y>
+    bool OwnerEqual(const SharedPtr<Y>& other) const {
+        return control_block_ == other.OwnerKey();
+    }
+
+    template <typename Y>
+    bool OwnerEqual(const WeakPtr<Y>& other) const {
+        return control_block_ == other.control_block_;
+    }
+
+    size_t OwnerHash() const {
+        return std::hash<const void*>()(control_block_);
+    }
+
+    ////////////////////////////////////////////////////////////////////////////////////////////////
+    // Expiry notifications
+
+    // Calls `callback()` exactly once, when the strong count drops to zero. Normally that happens
+    // on the thread which releases the last owner, right before the object is destroyed; but if
+    // the release races this call, the callback may instead run here, on this thread, possibly
+    // after the object is gone. Calls it right away if the object has already expired. The
+    // callback must not throw.
+    template <typename F>
+    void OnExpire(F callback) const {
+        if (!operator bool()) {
+            callback();
+            return;
+        }
+        struct Node : ExpiryNode {
+            explicit Node(F&& f) : callback(std::move(f)){};
+            F callback;
+        };
+        auto node = new Node(std::move(callback));
+        node->invoke = [](ExpiryNode* self, bool run) {
+            auto node = static_cast<Node*>(self);
+            if (run) {
+                node->callback();
+            }
+            delete node;
+        };
+        control_block_->AddExpiryNode(node);
     }
 
 private:
@@ -139,4 +230,10 @@ private:
 
     template <typename Y>
     friend class WeakPtr;
+
+    template <typename Y>
+    friend class EnableCompactSharedFromThis;
+
+    template <typename K, typename V>
+    friend class WeakKeyMap;
 };
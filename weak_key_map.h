@@ -0,0 +1,311 @@
+#pragma once
+
+#include "shared.h"
+#include "unique.h"
+#include "weak.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+// Side table keyed by object identity: `K` objects (`SharedPtr<K>` or `WeakPtr<K>`) to `V`s.
+//
+// A key is its control block, so aliases of one object are one key. The map keeps a weak reference
+// to every key's block, which keeps the address from being reused by another object while the
+// entry is there. Entries of expired objects are dropped when a lookup runs into them and on
+// rehash, or all at once by `Purge`.
+//
+// Open addressing with linear probing. The probed array holds only the block pointers, values live
+// in a parallel array and are touched on a hit only. Erasing shifts the rest of the run back, so
+// there are no tombstones. Not thread-safe, same as the standard containers.
+
+namespace weak_key_map_detail {
+
+// `SharedPtr<K>` and `WeakPtr<K>` are keys, `const K` included
+template <typename Ptr, typename K>
+inline constexpr bool kIsKey = false;
+
+template <typename Y, typename K>
+inline constexpr bool kIsKey<SharedPtr<Y>, K> = std::is_same_v<std::remove_const_t<Y>, K>;
+
+template <typename Y, typename K>
+inline constexpr bool kIsKey<WeakPtr<Y>, K> = std::is_same_v<std::remove_const_t<Y>, K>;
+
+}  // namespace weak_key_map_detail
+
+template <typename K, typename V>
+class WeakKeyMap {
+public:
+    static constexpr size_t kMinCapacity = 16;
+
+    ////////////////////////////////////////////////////////////////////////////////////////////////
+    // Constructors
+
+    WeakKeyMap() = default;
+
+    WeakKeyMap(const WeakKeyMap&) = delete;
+    WeakKeyMap& operator=(const WeakKeyMap&) = delete;
+
+    ////////////////////////////////////////////////////////////////////////////////////////////////
+    // Destructor
+
+    ~WeakKeyMap() {
+        Clear();
+    }
+
+    ////////////////////////////////////////////////////////////////////////////////////////////////
+    // Lookups
+
+    // Value of a live key, or `nullptr`
+    template <typename Ptr, std::enable_if_t<weak_key_map_detail::kIsKey<Ptr, K>, int> = 0>
+    V* Find(const Ptr& key) {
+        auto block = BlockOf(key);
+        if (!block || size_ == 0) {
+            return nullptr;
+        }
+        size_t index = Home(block);
+        while (blocks_[index]) {
+            if (blocks_[index] == block) {
+                if (Expired(index)) {
+                    EraseAt(index);
+                    return nullptr;
+                }
+                return Value(index);
+            }
+            index = (index + 1) & mask_;
+        }
+        return nullptr;
+    }
+
+    ////////////////////////////////////////////////////////////////////////////////////////////////
+    // Modifiers
+
+    // Value of `key`, created from `args` if there is none. Throws `BadWeakPtr` on an empty key.
+    template <typename Ptr, typename... Args,
+              std::enable_if_t<weak_key_map_detail::kIsKey<Ptr, K>, int> = 0>
+    V& Emplace(const Ptr& key, Args&&... args) {
+        auto block = MakeBlockOf(key);
+        if (!block) {
+            throw BadWeakPtr();
+        }
+        if ((size_ + 1) * 4 > capacity_ * 3) {
+            Rehash();
+        }
+        size_t index = Home(block);
+        while (blocks_[index]) {
+            if (blocks_[index] == block) {
+                return *Value(index);
+            }
+            if (Expired(index)) {
+                // The rest of the run shifts into `index`, look at it again
+                EraseAt(index);
+                continue;
+            }
+            index = (index + 1) & mask_;
+        }
+        new (Value(index)) V(std::forward<Args>(args)...);
+        block->WeakIncrement();
+        blocks_[index] = block;
+        ++size_;
+        return *Value(index);
+    }
+
+    // Returns whether there was such a key
+    template <typename Ptr, std::enable_if_t<weak_key_map_detail::kIsKey<Ptr, K>, int> = 0>
+    bool Erase(const Ptr& key) {
+        auto block = BlockOf(key);
+        if (!block || size_ == 0) {
+            return false;
+        }
+        size_t index = Home(block);
+        while (blocks_[index]) {
+            if (blocks_[index] == block) {
+                EraseAt(index);
+                return true;
+            }
+            index = (index + 1) & mask_;
+        }
+        return false;
+    }
+
+    // Drops the entries of all expired keys. Returns how many.
+    size_t Purge() {
+        size_t before = size_;
+        for (size_t index = 0; index < capacity_;) {
+            if (blocks_[index] && Expired(index)) {
+                EraseAt(index);
+            } else {
+                ++index;
+            }
+        }
+        return before - size_;
+    }
+
+    void Clear() {
+        for (size_t index = 0; index < capacity_; ++index) {
+            if (blocks_[index]) {
+                Drop(index);
+            }
+        }
+        size_ = 0;
+    }
+
+    ////////////////////////////////////////////////////////////////////////////////////////////////
+    // Observers
+
+    // Entries of expired keys included, until they are dropped
+    size_t Size() const {
+        return size_;
+    }
+
+    bool Empty() const {
+        return size_ == 0;
+    }
+
+    size_t Capacity() const {
+        return capacity_;
+    }
+
+    // `f(value)` for every entry with a live key
+    template <typename F>
+    void ForEach(F&& f) {
+        for (size_t index = 0; index < capacity_; ++index) {
+            if (blocks_[index] && !Expired(index)) {
+                f(*Value(index));
+            }
+        }
+    }
+
+private:
+    struct alignas(V) Storage {
+        unsigned char bytes[sizeof(V)];
+    };
+
+    // A lazy pointer without a block has never been a key: every entry holds a weak reference
+    template <typename Y>
+    static ControlBlock* BlockOf(const SharedPtr<Y>& key) {
+        return key.LoadBlock();
+    }
+
+    template <typename Y>
+    static ControlBlock* BlockOf(const WeakPtr<Y>& key) {
+        return key.control_block_;
+    }
+
+    // The block of a new key, allocated right now for a lazy pointer
+    template <typename Y>
+    static ControlBlock* MakeBlockOf(const SharedPtr<Y>& key) {
+        return key.Block();
+    }
+
+    template <typename Y>
+    static ControlBlock* MakeBlockOf(const WeakPtr<Y>& key) {
+        return key.control_block_;
+    }
+
+    size_t Home(ControlBlock* block) const {
+        // Fibonacci hashing, blocks are aligned so the low bits of the address are all the same
+        auto hash = static_cast<uint64_t>(reinterpret_cast<uintptr_t>(block));
+        return static_cast<size_t>((hash * 0x9E3779B97F4A7C15ull) >> shift_);
+    }
+
+    V* Value(size_t index) {
+        return std::launder(reinterpret_cast<V*>(&values_[index]));
+    }
+
+    bool Expired(size_t index) const {
+        return blocks_[index]->GetCount() == 0;
+    }
+
+    // Destroys the entry but leaves the slot as it is
+    void Drop(size_t index) {
+        Value(index)->~V();
+        auto block = blocks_[index];
+        blocks_[index] = nullptr;
+        if (block->WeakDecrement() == 0) {
+            block->BlockDelete();
+        }
+    }
+
+    // Backward shift deletion: entries after the hole move into it unless that would put them
+    // before their home slot
+    void EraseAt(size_t hole) {
+        Drop(hole);
+        --size_;
+        size_t index = hole;
+        while (true) {
+            index = (index + 1) & mask_;
+            if (!blocks_[index]) {
+                return;
+            }
+            size_t home = Home(blocks_[index]);
+            if (((index - home) & mask_) >= ((index - hole) & mask_)) {
+                new (Value(hole)) V(std::move(*Value(index)));
+                Value(index)->~V();
+                blocks_[hole] = blocks_[index];
+                blocks_[index] = nullptr;
+                hole = index;
+            }
+        }
+    }
+
+    // Grows, or only drops the expired entries if that leaves enough room
+    void Rehash() {
+        size_t live = 0;
+        for (size_t index = 0; index < capacity_; ++index) {
+            if (blocks_[index] && !Expired(index)) {
+                ++live;
+            }
+        }
+        size_t capacity = kMinCapacity;
+        while ((live + 1) * 2 > capacity) {
+            capacity <<= 1;
+        }
+
+        // Allocate first, so that running out of memory leaves the map as it was
+        UniquePtr<ControlBlock*[]> old_blocks(new ControlBlock*[capacity]());
+        UniquePtr<Storage[]> old_values(new Storage[capacity]);
+        old_blocks.Swap(blocks_);
+        old_values.Swap(values_);
+        size_t old_capacity = capacity_;
+        capacity_ = capacity;
+        mask_ = capacity - 1;
+        shift_ = 64;
+        for (size_t bits = capacity; bits > 1; bits >>= 1) {
+            --shift_;
+        }
+        size_ = 0;
+
+        for (size_t index = 0; index < old_capacity; ++index) {
+            auto block = old_blocks[index];
+            if (!block) {
+                continue;
+            }
+            auto value = std::launder(reinterpret_cast<V*>(&old_values[index]));
+            if (block->GetCount() != 0) {
+                size_t slot = Home(block);
+                while (blocks_[slot]) {
+                    slot = (slot + 1) & mask_;
+                }
+                new (Value(slot)) V(std::move(*value));
+                blocks_[slot] = block;
+                ++size_;
+                value->~V();
+            } else {
+                value->~V();
+                if (block->WeakDecrement() == 0) {
+                    block->BlockDelete();
+                }
+            }
+        }
+    }
+
+    UniquePtr<ControlBlock*[]> blocks_;
+    UniquePtr<Storage[]> values_;
+    size_t capacity_ = 0;
+    size_t mask_ = 0;
+    size_t shift_ = 64;
+    size_t size_ = 0;
+};
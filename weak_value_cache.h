@@ -0,0 +1,277 @@
+#pragma once
+
+#include "shared.h"
+#include "unique.h"
+#include "weak.h"
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstddef>
+#include <functional>
+#include <list>
+#include <mutex>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// Concurrent key -> `WeakPtr<V>` cache. Values die as soon as nobody outside of the cache owns
+// them; the cache only remembers how to find them while they are alive.
+//
+// * Keys are spread over independently locked shards, so unrelated lookups do not contend.
+// * `GetOrCreate` runs the factory outside of the shard lock, and concurrent misses on the same key
+//   wait for the first one instead of creating duplicates.
+// * Expired entries are purged lazily: a shard sweeps itself once it has doubled in size since the
+//   previous sweep, which keeps the cost amortized O(1) per insertion.
+// * Optionally the `strong_tail` most recently used values are kept alive by the cache itself,
+//   so that a value which is dropped and requested again right away is not rebuilt every time.
+//
+// Build with `SMART_POINTERS_THREADED` when the values are shared between threads.
+template <typename K, typename V, typename Hash = std::hash<K>>
+class WeakValueCache {
+public:
+    ////////////////////////////////////////////////////////////////////////////////////////////////
+    // Constructors
+
+    // `shards` is rounded up to a power of two. `strong_tail` is split evenly between the shards.
+    explicit WeakValueCache(size_t shards = 16, size_t strong_tail = 0)
+        : shard_count_(RoundUp(shards)), shards_(new Shard[RoundUp(shards)]) {
+        for (size_t i = 0; i < shard_count_; ++i) {
+            shards_[i].lru_capacity = (strong_tail + shard_count_ - 1) / shard_count_;
+        }
+    };
+
+    WeakValueCache(const WeakValueCache&) = delete;
+    WeakValueCache& operator=(const WeakValueCache&) = delete;
+
+    ////////////////////////////////////////////////////////////////////////////////////////////////
+    // Destructor
+
+    ~WeakValueCache() {
+        Clear();
+    }
+
+    ////////////////////////////////////////////////////////////////////////////////////////////////
+    // Lookups
+
+    // Live value for `key` or an empty pointer
+    SharedPtr<V> Get(const K& key) {
+        SharedPtr<V> evicted;
+        Shard& shard = ShardFor(key);
+        std::lock_guard lock(shard.mutex);
+        auto it = shard.map.find(key);
+        if (it == shard.map.end() || it->second.pending) {
+            return SharedPtr<V>();
+        }
+        auto value = it->second.value.Lock();
+        if (value) {
+            evicted = Touch(shard, it);
+        }
+        return value;
+    }
+
+    // Live value for `key`, or the result of `factory()` which must return a `SharedPtr<V>`.
+    // The factory is called at most once at a time for a given key; if it throws, the exception is
+    // propagated and one of the waiting callers (if any) gets to try again. An empty result is
+    // returned as is and not cached.
+    template <typename Factory>
+    SharedPtr<V> GetOrCreate(const K& key, Factory&& factory) {
+        SharedPtr<V> evicted;
+        Shard& shard = ShardFor(key);
+        std::unique_lock lock(shard.mutex);
+        while (true) {
+            auto it = shard.map.find(key);
+            if (it == shard.map.end()) {
+                break;
+            }
+            if (it->second.pending) {
+                shard.created.wait(lock);
+                continue;
+            }
+            auto value = it->second.value.Lock();
+            if (value) {
+                evicted = Touch(shard, it);
+                return value;
+            }
+            // Expired, rebuild it in place
+            break;
+        }
+        shard.map[key].pending = true;
+        MaybePurge(shard);
+        lock.unlock();
+
+        SharedPtr<V> value;
+        try {
+            value = factory();
+        } catch (...) {
+            lock.lock();
+            shard.map.erase(key);
+            shard.created.notify_all();
+            throw;
+        }
+
+        lock.lock();
+        // Pending entries are left alone by `Erase` and purging, so it must still be there
+        auto it = shard.map.find(key);
+        if (!value) {
+            // Nothing to remember; the next caller runs its own factory
+            shard.map.erase(it);
+            shard.created.notify_all();
+            return value;
+        }
+        it->second.value = value;
+        it->second.pending = false;
+        evicted = Touch(shard, it);
+        shard.created.notify_all();
+        return value;
+    }
+
+    ////////////////////////////////////////////////////////////////////////////////////////////////
+    // Modifiers
+
+    void Erase(const K& key) {
+        SharedPtr<V> evicted;
+        Shard& shard = ShardFor(key);
+        std::lock_guard lock(shard.mutex);
+        auto it = shard.map.find(key);
+        if (it == shard.map.end() || it->second.pending) {
+            return;
+        }
+        if (it->second.pinned) {
+            evicted = std::move(it->second.lru->second);
+            shard.lru.erase(it->second.lru);
+        }
+        shard.map.erase(it);
+    }
+
+    // Forgets everything. Values kept alive only by the strong tail die, in bulk and outside of the
+    // locks. Keys being created right now stay, their `GetOrCreate` still has to finish.
+    void Clear() {
+        std::vector<SharedPtr<V>> released;
+        for (size_t i = 0; i < shard_count_; ++i) {
+            Shard& shard = shards_[i];
+            std::lock_guard lock(shard.mutex);
+            for (auto& [key, value] : shard.lru) {
+                released.push_back(std::move(value));
+            }
+            shard.lru.clear();
+            for (auto it = shard.map.begin(); it != shard.map.end();) {
+                if (!it->second.pending) {
+                    it = shard.map.erase(it);
+                } else {
+                    ++it;
+                }
+            }
+            shard.next_purge = kMinPurgeSize;
+        }
+        ReleaseAll(released);
+    }
+
+    // Drop every expired entry right now
+    void Purge() {
+        for (size_t i = 0; i < shard_count_; ++i) {
+            std::lock_guard lock(shards_[i].mutex);
+            PurgeLocked(shards_[i]);
+        }
+    }
+
+    ////////////////////////////////////////////////////////////////////////////////////////////////
+    // Observers
+
+    // Number of entries, including expired ones which have not been purged yet
+    size_t Size() const {
+        size_t res = 0;
+        for (size_t i = 0; i < shard_count_; ++i) {
+            std::lock_guard lock(shards_[i].mutex);
+            res += shards_[i].map.size();
+        }
+        return res;
+    }
+
+private:
+    static constexpr size_t kMinPurgeSize = 16;
+    static constexpr size_t kCacheLine = 64;
+
+    using Lru = std::list<std::pair<K, SharedPtr<V>>>;
+
+    struct Entry {
+        WeakPtr<V> value;
+        bool pending = false;
+        // Whether the value is also in the strong tail, at position `lru`
+        bool pinned = false;
+        typename Lru::iterator lru;
+    };
+
+    struct alignas(kCacheLine) Shard {
+        mutable std::mutex mutex;
+        std::condition_variable created;
+        std::unordered_map<K, Entry, Hash> map;
+        size_t next_purge = kMinPurgeSize;
+        Lru lru;
+        size_t lru_capacity = 0;
+    };
+
+    static size_t RoundUp(size_t n) {
+        size_t res = 1;
+        while (res < n) {
+            res <<= 1;
+        }
+        return res;
+    }
+
+    Shard& ShardFor(const K& key) {
+        size_t hash = Hash()(key);
+        // Identity hashes (e.g. of integers) would otherwise map neighbouring keys to one shard
+        hash ^= hash >> 31;
+        hash *= 0x9e3779b97f4a7c15ULL;
+        hash ^= hash >> 29;
+        return shards_[hash & (shard_count_ - 1)];
+    }
+
+    // Moves the entry to the front of the strong tail. Returns the value that fell off the end,
+    // which the caller must release only after unlocking: its destructor may call back into us.
+    // Expired entries are not pinned, purging would leave their node in the tail behind.
+    SharedPtr<V> Touch(Shard& shard, typename std::unordered_map<K, Entry, Hash>::iterator it) {
+        if (shard.lru_capacity == 0) {
+            return SharedPtr<V>();
+        }
+        Entry& entry = it->second;
+        if (entry.pinned) {
+            shard.lru.splice(shard.lru.begin(), shard.lru, entry.lru);
+            return SharedPtr<V>();
+        }
+        auto value = entry.value.Lock();
+        if (!value) {
+            return SharedPtr<V>();
+        }
+        shard.lru.emplace_front(it->first, std::move(value));
+        entry.pinned = true;
+        entry.lru = shard.lru.begin();
+        if (shard.lru.size() <= shard.lru_capacity) {
+            return SharedPtr<V>();
+        }
+        auto evicted = std::move(shard.lru.back().second);
+        shard.map.find(shard.lru.back().first)->second.pinned = false;
+        shard.lru.pop_back();
+        return evicted;
+    }
+
+    void MaybePurge(Shard& shard) {
+        if (shard.map.size() >= shard.next_purge) {
+            PurgeLocked(shard);
+        }
+    }
+
+    void PurgeLocked(Shard& shard) {
+        for (auto it = shard.map.begin(); it != shard.map.end();) {
+            if (!it->second.pending && it->second.value.Expired()) {
+                it = shard.map.erase(it);
+            } else {
+                ++it;
+            }
+        }
+        shard.next_purge = std::max(kMinPurgeSize, 2 * shard.map.size());
+    }
+
+    const size_t shard_count_;
+    UniquePtr<Shard[]> shards_;
+};